@@ -0,0 +1,355 @@
+/*
+ * st2play - very accurate C port of Scream Tracker 2.xx's replayer,
+ *
+ * Copyright 2017 Sergei "x0r" Kolzun
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * st2bench - generates synthetic worst-case modules and times loading,
+ * tick processing and rendering. Results go to stdout as JSON lines, one
+ * object per measurement, so runs can be diffed across commits.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "st2play.h"
+#include "stmload.h"
+
+#define BENCH_RATE     48000
+#define BENCH_FRAMES   (BENCH_RATE * 120)
+#define BENCH_BLOCK    4096
+#define BENCH_LOADS    200
+
+typedef struct bench_module_s {
+	const char *name;
+	uint8_t tempo;
+	uint8_t patterns;
+	uint16_t loop_length;	/* of the shortest sample, doubled for each next one */
+} bench_module_t;
+
+// All four channels retrigger every row with a tick effect running.
+static const bench_module_t modules[] = {
+	{ "worst",    0x60, 64,  32 },
+	{ "ticks",    0xf0, 64,  32 },
+	{ "patterns", 0x60, 255, 256 },
+};
+
+static const uint8_t effects[][2] = {
+	{ FX_VIBRATO, 0x48 },
+	{ FX_PORTAMENTODOWN, 0x02 },
+	{ FX_PORTAMENTOUP, 0x02 },
+	{ FX_TONEPORTAMENTO, 0x08 },
+	{ FX_TREMOR, 0x21 },
+	{ FX_ARPEGGIO, 0x37 },
+	{ FX_VOLUMESLIDE, 0x01 },
+	{ FX_VIBRA_VSLIDE, 0x10 },
+};
+
+static const char *mixer_names[] = { "auto", "scalar", "ssse3", "avx2", "neon" };
+
+static uint32_t seed = 1;
+
+static uint32_t bench_rand(void);
+static void put16(uint8_t *p, uint16_t v);
+static uint8_t *generate(const bench_module_t *mod, size_t *size);
+static double now(void);
+static void result(const char *module, const char *bench, const char *mixer, const char *unit, uint64_t count, double secs);
+static void bench_load(const bench_module_t *mod, const uint8_t *data, size_t size, const char *path);
+static void bench_ticks(const bench_module_t *mod, st2_song_t *song, uint16_t rate);
+static void bench_render(const bench_module_t *mod, st2_song_t *song, uint16_t rate, uint64_t frames);
+
+static uint32_t bench_rand(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return seed >> 16;
+}
+
+static void put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+
+// Version 2.21 module image, patterns stored unpacked.
+static uint8_t *generate(const bench_module_t *mod, size_t *size)
+{
+	size_t i, row, chn, offset, sample_size = 0;
+	uint8_t *data, *p, *cell;
+	uint16_t length;
+	uint8_t smp, vol, fx;
+
+	for(i = 0; i < 8; ++i)
+		sample_size += ((mod->loop_length << i) + 15) & ~15;
+
+	offset = (48 + 31 * 32 + 128 + mod->patterns * 1024 + 15) & ~15;
+	*size = offset + sample_size;
+
+	data = (uint8_t *)(calloc(*size, 1));
+	if(data == NULL)
+		return NULL;
+
+	snprintf((char *)data, 20, "bench %s", mod->name);
+	memcpy(data + 20, "!Scream!\x1a", 9);
+	data[29] = 2;
+	data[30] = 2;
+	data[31] = 21;
+	data[32] = mod->tempo;
+	data[33] = mod->patterns;
+	data[34] = 64;
+
+	// Eight looped samples, every one of them looping from its first byte.
+	for(i = 0; i < 31; ++i)
+	{
+		p = data + 48 + i * 32;
+		snprintf((char *)p, 12, "bench%02d.smp", (int)i + 1);
+		put16(p + 24, 8448);
+		if(i >= 8)
+			continue;
+
+		length = mod->loop_length << i;
+		put16(p + 14, offset >> 4);
+		put16(p + 16, length);
+		put16(p + 18, 0);
+		put16(p + 20, length);
+		p[22] = 64;
+		put16(p + 24, 8448);
+
+		for(row = 0; row < length; ++row)
+			data[offset + row] = bench_rand();
+		offset += (length + 15) & ~15;
+	}
+
+	p = data + 48 + 31 * 32;
+	for(i = 0; i < 128; ++i)
+		p[i] = i < mod->patterns ? i : 99;
+
+	p += 128;
+	for(i = 0; i < mod->patterns; ++i)
+	{
+		for(row = 0; row < 64; ++row)
+		{
+			for(chn = 0; chn < 4; ++chn)
+			{
+				cell = p + i * 1024 + row * 16 + chn * 4;
+				smp = 1 + bench_rand() % 8;
+				vol = bench_rand() % 2 ? 65 : 32 + bench_rand() % 33;
+				fx = (row + chn) % (sizeof(effects) / sizeof(effects[0]));
+				cell[0] = (1 + bench_rand() % 3) << 4 | bench_rand() % 12;
+				cell[1] = smp << 3 | (vol & 7);
+				cell[2] = (vol >> 3) << 4 | effects[fx][0];
+				cell[3] = effects[fx][1];
+			}
+		}
+	}
+
+	return data;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void result(const char *module, const char *bench, const char *mixer, const char *unit, uint64_t count, double secs)
+{
+	printf("{\"module\": \"%s\", \"bench\": \"%s\", \"mixer\": \"%s\", \"%ss\": %llu, \"seconds\": %.6f, \"ns_per_%s\": %.3f, \"m%ss_per_s\": %.3f}\n",
+		module, bench, mixer, unit, (unsigned long long)count, secs, unit, secs * 1e9 / count, unit, count / secs / 1e6);
+	fflush(stdout);
+}
+
+static void bench_load(const bench_module_t *mod, const uint8_t *data, size_t size, const char *path)
+{
+	size_t i;
+	double start;
+	st2_song_t *song;
+	FILE *fp;
+
+	start = now();
+	for(i = 0; i < BENCH_LOADS; ++i)
+	{
+		if((song = stm_load_song_mem(data, size)) == NULL)
+			return;
+		st2_song_release(song);
+	}
+	result(mod->name, "stm_load_mem", "none", "load", BENCH_LOADS, now() - start);
+
+	if((fp = fopen(path, "wb")) == NULL)
+		return;
+	fwrite(data, 1, size, fp);
+	fclose(fp);
+
+	start = now();
+	for(i = 0; i < BENCH_LOADS; ++i)
+	{
+		if((song = stm_load_song(path)) == NULL)
+			break;
+		st2_song_release(song);
+	}
+	if(i == BENCH_LOADS)
+		result(mod->name, "stm_load", "none", "load", BENCH_LOADS, now() - start);
+
+	remove(path);
+}
+
+// Tick processing alone, without any mixing in between.
+static void bench_ticks(const bench_module_t *mod, st2_song_t *song, uint16_t rate)
+{
+	st2_context_t *ctx;
+	st2_timeline_t timeline;
+	uint64_t ticks = 0;
+	double start;
+
+	if((ctx = st2_tracker_init()) == NULL)
+		return;
+
+	st2_tracker_set_song(ctx, song);
+	st2_tracker_start(ctx, rate);
+
+	start = now();
+	while(ticks < 1000000) {
+		st2_analyze_timeline(ctx, &timeline);
+		ticks += timeline.ticks;
+	}
+	result(mod->name, "process_tick", "none", "tick", ticks, now() - start);
+
+	st2_tracker_destroy(ctx);
+}
+
+static void bench_render(const bench_module_t *mod, st2_song_t *song, uint16_t rate, uint64_t frames)
+{
+	static uint8_t buf[BENCH_BLOCK * sizeof(float) * 2];
+	st2_context_t *ctx;
+	uint64_t i, done;
+	uint32_t sum = 0;
+	double start;
+	int mixer;
+
+	if((ctx = st2_tracker_init()) == NULL)
+		return;
+
+	st2_tracker_set_song(ctx, song);
+	st2_tracker_start(ctx, rate);
+
+	start = now();
+	for(i = 0; i < frames; ++i)
+		sum += st2_render_sample(ctx);
+	result(mod->name, "st2_render_sample", "reference", "frame", frames, now() - start);
+
+	for(mixer = ST2_MIXER_SCALAR; mixer <= ST2_MIXER_NEON; ++mixer)
+	{
+		if(st2_set_mixer(ctx, mixer) < 0)
+			continue;
+
+		start = now();
+		for(done = 0; done < frames; done += st2_render_block(ctx, buf, BENCH_BLOCK));
+		result(mod->name, "st2_render_block", mixer_names[mixer], "frame", done, now() - start);
+
+		start = now();
+		for(done = 0; done < frames; done += st2_render_s16(ctx, (int16_t *)buf, BENCH_BLOCK));
+		result(mod->name, "st2_render_s16", mixer_names[mixer], "frame", done, now() - start);
+
+		start = now();
+		for(done = 0; done < frames; done += st2_render_f32_stereo(ctx, (float *)buf, BENCH_BLOCK));
+		result(mod->name, "st2_render_f32_stereo", mixer_names[mixer], "frame", done, now() - start);
+	}
+
+	// Keeps the reference loop from being optimized away.
+	if(sum == 0 && buf[0] == 0)
+		fprintf(stderr, "silent\n");
+
+	st2_tracker_destroy(ctx);
+}
+
+static void usage(const char *name)
+{
+	printf("usage: %s [options]\n", name);
+	printf("  -s <rate>    sample rate (default %d)\n", BENCH_RATE);
+	printf("  -f <frames>  frames rendered per measurement (default %d)\n", BENCH_FRAMES);
+	printf("  -m <module>  only run this module (worst, ticks, patterns)\n");
+	printf("  -w <dir>     where to write the module for the stm_load test (default .)\n");
+	exit(-1);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *only = NULL, *dir = ".";
+	char path[1024];
+	uint32_t rate = BENCH_RATE;
+	uint64_t frames = BENCH_FRAMES;
+	uint8_t *data;
+	size_t i, size;
+	st2_song_t *song;
+	int arg;
+
+	for(arg = 1; arg < argc; ++arg)
+	{
+		if(argv[arg][0] != '-' || argv[arg][1] == '\0' || arg + 1 == argc)
+			usage(argv[0]);
+
+		switch(argv[arg][1])
+		{
+			case 's':
+				rate = strtoul(argv[++arg], NULL, 10);
+				break;
+			case 'f':
+				frames = strtoull(argv[++arg], NULL, 10);
+				break;
+			case 'm':
+				only = argv[++arg];
+				break;
+			case 'w':
+				dir = argv[++arg];
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if(rate == 0 || rate > 65535 || frames == 0)
+		usage(argv[0]);
+
+	for(i = 0; i < sizeof(modules) / sizeof(modules[0]); ++i)
+	{
+		if(only != NULL && strcmp(only, modules[i].name))
+			continue;
+
+		seed = 1;
+		if((data = generate(&modules[i], &size)) == NULL)
+			return 1;
+
+		snprintf(path, sizeof(path), "%s/st2bench-%s.stm", dir, modules[i].name);
+		bench_load(&modules[i], data, size, path);
+
+		if((song = stm_load_song_mem(data, size)) == NULL) {
+			free(data);
+			return 1;
+		}
+
+		bench_ticks(&modules[i], song, rate);
+		bench_render(&modules[i], song, rate, frames);
+
+		st2_song_release(song);
+		free(data);
+	}
+
+	return 0;
+}
@@ -0,0 +1,773 @@
+/*
+ * st2play - very accurate C port of Scream Tracker 2.xx's replayer,
+ *
+ * Copyright 2017 Sergei "x0r" Kolzun
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * st2d - plays many modules at once for local clients.
+ *
+ * Every connection to the Unix socket is one session with its own
+ * context. Sessions are rendered in small chunks by a pool of worker
+ * threads, earliest deadline first: a session's deadline is the moment
+ * its client would run out of audio, and it is only rendered once that
+ * falls within the lead time. Modules are loaded and indexed by separate
+ * loader threads, so a slow disk holds up only the session that asked.
+ * The main thread does all socket I/O and installs the loaded songs.
+ *
+ * Client to server, one command per line:
+ *   load <file> [rate]   load a module and start playing it (default 48000 Hz),
+ *                        replied to once it is loaded; a newer load replaces it
+ *   seek <seconds>       continue from that point of the song
+ *   pause / play         pause and resume
+ *   stop                 pause and go back to the start of the song
+ *   quit                 close the session
+ *
+ * Server to client, packets of a type byte, a little-endian 32-bit length
+ * and the payload: 'A' is signed 16-bit mono PCM, 'T' a reply line
+ * ("ok ...", "error ..." or "end" once the song has finished).
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "st2play.h"
+#include "stmload.h"
+#include "st2ring.h"
+
+#define ST2D_SOCKET   "/tmp/st2d.sock"
+#define ST2D_SESSIONS 256
+#define ST2D_WORKERS  4
+#define ST2D_LOADERS  2
+#define ST2D_LEAD_MS  200
+#define ST2D_RATE     48000
+#define ST2D_CHUNK    1024	/* frames rendered per scheduling slot */
+#define ST2D_PACKET   4096	/* largest PCM payload */
+#define ST2D_COMMAND  512
+#define ST2D_REPLIES  1024
+
+// A load in flight, owned by the loader threads until 'done'.
+typedef struct load_s {
+	struct load_s *next;	/* in the queue */
+	char path[ST2D_COMMAND];
+	uint32_t rate;
+	uint8_t done;
+	uint8_t abandoned;	/* its session closed or asked for another load */
+	st2_context_t *ctx;
+	st2_seek_index_t *index;
+	const char *error;	/* reply when ctx is NULL */
+} load_t;
+
+typedef struct session_s {
+	int fd;
+	load_t *load;		/* being loaded for this session, or NULL */
+	st2_context_t *ctx;
+	st2_seek_index_t *index;
+	st2_ring_t ring;	/* workers produce, the main thread consumes */
+	uint32_t rate;
+	double start;		/* when frame 0 of the stream is due at the client */
+	uint64_t rendered;	/* frames since 'start' */
+	uint8_t playing;
+	uint8_t busy;		/* a worker is rendering it */
+	uint8_t ended;
+	uint8_t end_sent;
+	char command[ST2D_COMMAND];
+	size_t command_len;
+	char replies[ST2D_REPLIES];
+	size_t replies_len;
+	uint8_t packet[5 + ST2D_PACKET];
+	size_t packet_pos, packet_len;
+} session_t;
+
+static session_t *sessions[ST2D_SESSIONS];
+static size_t session_count = 0;
+static uint32_t lead_ms = ST2D_LEAD_MS;
+static const char *cache_dir = NULL;
+static volatile sig_atomic_t quit = 0;
+static int stopping = 0;		/* quit as seen by the workers, under the lock */
+static load_t *load_queue = NULL;
+
+// Guards the session list and every field the workers look at.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t idle = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t loads = PTHREAD_COND_INITIALIZER;
+
+static double now(void);
+static session_t *next_session(double t);
+static void *worker(void *arg);
+static void load_module(load_t *load);
+static void load_free(load_t *load);
+static load_t *load_cancel(load_t *load);
+static void *loader(void *arg);
+static void reply(session_t *s, const char *text);
+static void wait_idle(session_t *s);
+static void flush(session_t *s);
+static void command_load(session_t *s, char *args);
+static void session_loaded(session_t *s);
+static void command_seek(session_t *s, char *args);
+static void command(session_t *s, char *line);
+static int session_read(session_t *s);
+static int session_write(session_t *s);
+static int session_add(int fd);
+static void session_remove(size_t i);
+static void on_signal(int sig);
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Earliest deadline among the sessions that are due for another chunk.
+static session_t *next_session(double t)
+{
+	size_t i;
+	double deadline, best_deadline = 0;
+	session_t *s, *best = NULL;
+
+	for(i = 0; i < session_count; ++i)
+	{
+		s = sessions[i];
+		if(!s->playing || s->busy || s->ended || st2_ring_writable(&s->ring) < ST2D_CHUNK * sizeof(int16_t))
+			continue;
+
+		deadline = s->start + (double)s->rendered / s->rate;
+		if(deadline > t + lead_ms / 1000.0)
+			continue;
+
+		if(best == NULL || deadline < best_deadline) {
+			best = s;
+			best_deadline = deadline;
+		}
+	}
+
+	return best;
+}
+
+static void *worker(void *arg)
+{
+	int16_t buf[ST2D_CHUNK];
+	struct timespec ts;
+	session_t *s;
+	size_t done;
+
+	pthread_mutex_lock(&lock);
+
+	while(!stopping) {
+		if((s = next_session(now())) == NULL) {
+			// Nothing due: sleep until a deadline could have moved into the lead window.
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += 2000000;
+			if(ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&work, &lock, &ts);
+			continue;
+		}
+
+		s->busy = 1;
+		pthread_mutex_unlock(&lock);
+
+		done = st2_get_position(s->ctx) >> 8 ? 0 : st2_render_s16(s->ctx, buf, ST2D_CHUNK);
+		st2_ring_write(&s->ring, buf, done * sizeof(int16_t));
+
+		pthread_mutex_lock(&lock);
+		s->rendered += done;
+		if(done < ST2D_CHUNK)
+			s->ended = 1;
+		s->busy = 0;
+		pthread_cond_broadcast(&idle);
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	return arg;
+}
+
+// Runs on a loader thread, the header is checked before anything is loaded.
+static void load_module(load_t *load)
+{
+	uint8_t header[48];
+	size_t len;
+	stm_header_t stm;
+	st2_song_t *song;
+	FILE *fp;
+
+	if((fp = fopen(load->path, "rb")) == NULL) {
+		load->error = "error can't open module";
+		return;
+	}
+	len = fread(header, 1, sizeof(header), fp);
+	fclose(fp);
+
+	switch(stm_read_header(header, len, &stm))
+	{
+		case STM_BAD_TYPE:
+			load->error = "error not a module";
+			return;
+		case STM_BAD_VERSION:
+			load->error = "error unknown module version";
+			return;
+		case STM_OLD_VERSION:
+			load->error = "error module versions before 2.00 are not supported";
+			return;
+	}
+
+	song = cache_dir != NULL ? stm_load_song_cached(load->path, cache_dir) : stm_load_song(load->path);
+	if(song == NULL) {
+		load->error = "error can't load module";
+		return;
+	}
+
+	load->ctx = st2_tracker_init();
+	if(load->ctx != NULL) {
+		st2_tracker_set_song(load->ctx, song);
+		st2_tracker_start(load->ctx, load->rate);
+		st2_set_position(load->ctx, 0);
+		load->index = st2_seek_index_build(load->ctx, 4, 0);
+	}
+	st2_song_release(song);
+
+	if(load->index == NULL) {
+		st2_tracker_destroy(load->ctx);
+		load->ctx = NULL;
+		load->error = "error out of memory";
+	}
+}
+
+static void load_free(load_t *load)
+{
+	st2_seek_index_destroy(load->index);
+	st2_tracker_destroy(load->ctx);
+	free(load);
+}
+
+/*
+ * Called with the lock held. Returns the load when the caller is to free
+ * it: done, or still queued and taken off the queue. One that a loader is
+ * working on is marked abandoned instead, and freed by that loader.
+ */
+static load_t *load_cancel(load_t *load)
+{
+	load_t **p;
+
+	if(load == NULL || load->done)
+		return load;
+
+	for(p = &load_queue; *p != NULL; p = &(*p)->next)
+	{
+		if(*p == load) {
+			*p = load->next;
+			return load;
+		}
+	}
+
+	load->abandoned = 1;
+
+	return NULL;
+}
+
+static void *loader(void *arg)
+{
+	load_t *load;
+
+	pthread_mutex_lock(&lock);
+
+	while(!stopping) {
+		if((load = load_queue) == NULL) {
+			pthread_cond_wait(&loads, &lock);
+			continue;
+		}
+		load_queue = load->next;
+
+		pthread_mutex_unlock(&lock);
+		load_module(load);
+		pthread_mutex_lock(&lock);
+
+		// Nobody is waiting for it any more.
+		if(load->abandoned) {
+			pthread_mutex_unlock(&lock);
+			load_free(load);
+			pthread_mutex_lock(&lock);
+			continue;
+		}
+
+		load->done = 1;
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	return arg;
+}
+
+static void reply(session_t *s, const char *text)
+{
+	size_t len = strlen(text);
+
+	if(s->replies_len + len + 1 > ST2D_REPLIES)
+		return;
+
+	memcpy(s->replies + s->replies_len, text, len);
+	s->replies[s->replies_len + len] = '\n';
+	s->replies_len += len + 1;
+}
+
+// Called with the lock held; afterwards no worker touches the session until it is released.
+static void wait_idle(session_t *s)
+{
+	while(s->busy)
+		pthread_cond_wait(&idle, &lock);
+}
+
+// Drops rendered audio the client hasn't been sent yet; the main thread is the ring's consumer.
+static void flush(session_t *s)
+{
+	uint8_t buf[ST2D_PACKET];
+
+	while(st2_ring_read(&s->ring, buf, sizeof(buf)) != 0);
+}
+
+static void command_load(session_t *s, char *args)
+{
+	char *path, *rate_arg;
+	uint32_t rate = ST2D_RATE;
+	load_t *load, *old, **tail;
+
+	path = strtok(args, " \t");
+	rate_arg = strtok(NULL, " \t");
+	if(rate_arg != NULL)
+		rate = strtoul(rate_arg, NULL, 10);
+
+	if(path == NULL || rate == 0 || rate > 65535) {
+		reply(s, "error usage: load <file> [rate]");
+		return;
+	}
+
+	if((load = (load_t *)(calloc(1, sizeof(load_t)))) == NULL) {
+		reply(s, "error out of memory");
+		return;
+	}
+
+	// The command buffer is no longer than the path.
+	strcpy(load->path, path);
+	load->rate = rate;
+
+	pthread_mutex_lock(&lock);
+	old = load_cancel(s->load);
+	s->load = load;
+	for(tail = &load_queue; *tail != NULL; tail = &(*tail)->next);
+	*tail = load;
+	pthread_cond_signal(&loads);
+	pthread_mutex_unlock(&lock);
+
+	if(old != NULL)
+		load_free(old);
+}
+
+// Installs a finished load; workers keep rendering the old song until then.
+static void session_loaded(session_t *s)
+{
+	char text[64];
+	load_t *load;
+	st2_context_t *old_ctx = NULL;
+	st2_seek_index_t *old_index = NULL;
+
+	pthread_mutex_lock(&lock);
+	if((load = s->load) == NULL || !load->done) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+
+	s->load = NULL;
+	if(load->ctx != NULL) {
+		wait_idle(s);
+		old_ctx = s->ctx;
+		old_index = s->index;
+		s->ctx = load->ctx;
+		s->index = load->index;
+		s->rate = load->rate;
+		s->start = now();
+		s->rendered = 0;
+		s->playing = 1;
+		s->ended = 0;
+		s->end_sent = 0;
+		flush(s);
+	}
+	pthread_mutex_unlock(&lock);
+
+	st2_seek_index_destroy(old_index);
+	st2_tracker_destroy(old_ctx);
+
+	if(load->ctx != NULL) {
+		snprintf(text, sizeof(text), "ok load %u %llu", (unsigned)load->rate, (unsigned long long)load->index->length);
+		reply(s, text);
+	} else {
+		reply(s, load->error);
+	}
+
+	free(load);
+}
+
+static void command_seek(session_t *s, char *args)
+{
+	double seconds = strtod(args, NULL);
+	int result;
+
+	if(s->ctx == NULL || seconds < 0) {
+		reply(s, "error nothing to seek");
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	wait_idle(s);
+	result = st2_seek_frame(s->ctx, s->index, (uint64_t)(seconds * s->rate));
+	if(result == 0) {
+		s->start = now();
+		s->rendered = 0;
+		s->ended = 0;
+		s->end_sent = 0;
+		flush(s);
+	}
+	pthread_mutex_unlock(&lock);
+
+	reply(s, result == 0 ? "ok seek" : "error seek failed");
+}
+
+static void command(session_t *s, char *line)
+{
+	char *args;
+
+	args = line + strcspn(line, " \t");
+	if(*args != '\0')
+		*args++ = '\0';
+
+	if(!strcmp(line, "load")) {
+		command_load(s, args);
+	} else if(!strcmp(line, "seek")) {
+		command_seek(s, args);
+	} else if(!strcmp(line, "stop") || !strcmp(line, "pause") || !strcmp(line, "play")) {
+		pthread_mutex_lock(&lock);
+		wait_idle(s);
+		// Audio still in the ring was rendered before the pause, it goes out first.
+		if(s->ctx != NULL && !s->playing && !strcmp(line, "play")) {
+			s->start = now();
+			s->rendered = st2_ring_readable(&s->ring) / sizeof(int16_t);
+		}
+		s->playing = s->ctx != NULL && !strcmp(line, "play");
+		// Frame 0 is always a checkpoint, so this can't fail.
+		if(s->ctx != NULL && !strcmp(line, "stop")) {
+			flush(s);
+			st2_seek_frame(s->ctx, s->index, 0);
+			s->ended = 0;
+			s->end_sent = 0;
+		}
+		pthread_mutex_unlock(&lock);
+		if(s->ctx == NULL)
+			reply(s, "error nothing loaded");
+		else
+			reply(s, !strcmp(line, "stop") ? "ok stop" : !strcmp(line, "pause") ? "ok pause" : "ok play");
+	} else if(line[0] != '\0') {
+		reply(s, "error unknown command");
+	}
+}
+
+// Returns -1 once the session should be closed.
+static int session_read(session_t *s)
+{
+	char buf[256], *line;
+	ssize_t len, i;
+
+	len = read(s->fd, buf, sizeof(buf));
+	if(len <= 0)
+		return len < 0 && (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+
+	for(i = 0; i < len; ++i)
+	{
+		if(buf[i] == '\r')
+			continue;
+
+		if(buf[i] != '\n') {
+			if(s->command_len < ST2D_COMMAND - 1)
+				s->command[s->command_len++] = buf[i];
+			continue;
+		}
+
+		s->command[s->command_len] = '\0';
+		s->command_len = 0;
+		line = s->command;
+
+		if(!strcmp(line, "quit"))
+			return -1;
+		command(s, line);
+	}
+
+	return 0;
+}
+
+// Replies go out first, then whatever audio is ready, then "end".
+static int session_write(session_t *s)
+{
+	size_t len = 0;
+	ssize_t sent;
+	uint8_t type = 'A';
+
+	if(s->packet_pos == s->packet_len) {
+		if(s->replies_len) {
+			type = 'T';
+			len = s->replies_len;
+			memcpy(s->packet + 5, s->replies, len);
+			s->replies_len = 0;
+		} else if(s->playing) {
+			len = st2_ring_read(&s->ring, s->packet + 5, ST2D_PACKET);
+			pthread_mutex_lock(&lock);
+			if(len == 0 && s->ended && !s->end_sent && st2_ring_readable(&s->ring) == 0) {
+				reply(s, "end");
+				s->end_sent = 1;
+			}
+			pthread_mutex_unlock(&lock);
+		}
+
+		if(len == 0)
+			return 0;
+
+		s->packet[0] = type;
+		s->packet[1] = len & 0xff;
+		s->packet[2] = (len >> 8) & 0xff;
+		s->packet[3] = (len >> 16) & 0xff;
+		s->packet[4] = len >> 24;
+		s->packet_pos = 0;
+		s->packet_len = len + 5;
+	}
+
+	sent = write(s->fd, s->packet + s->packet_pos, s->packet_len - s->packet_pos);
+	if(sent < 0)
+		return errno == EAGAIN || errno == EINTR ? 0 : -1;
+
+	s->packet_pos += sent;
+
+	return 0;
+}
+
+static int session_add(int fd)
+{
+	session_t *s;
+
+	if(session_count == ST2D_SESSIONS)
+		return -1;
+
+	s = (session_t *)(calloc(1, sizeof(session_t)));
+	if(s == NULL)
+		return -1;
+
+	// Twice the lead time at the highest rate a session can ask for.
+	if(st2_ring_init(&s->ring, 65535 * sizeof(int16_t) * lead_ms / 500) < 0) {
+		free(s);
+		return -1;
+	}
+
+	s->fd = fd;
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	pthread_mutex_lock(&lock);
+	sessions[session_count++] = s;
+	pthread_mutex_unlock(&lock);
+
+	return 0;
+}
+
+static void session_remove(size_t i)
+{
+	session_t *s = sessions[i];
+	load_t *load;
+
+	pthread_mutex_lock(&lock);
+	wait_idle(s);
+	sessions[i] = sessions[--session_count];
+	load = load_cancel(s->load);
+	pthread_mutex_unlock(&lock);
+
+	if(load != NULL)
+		load_free(load);
+
+	close(s->fd);
+	st2_seek_index_destroy(s->index);
+	st2_tracker_destroy(s->ctx);
+	st2_ring_free(&s->ring);
+	free(s);
+}
+
+static void on_signal(int sig)
+{
+	quit = sig;
+}
+
+static void usage(const char *name)
+{
+	printf("usage: %s [options]\n", name);
+	printf("  -u <path>    socket to listen on (default %s)\n", ST2D_SOCKET);
+	printf("  -w <count>   render threads (default %d)\n", ST2D_WORKERS);
+	printf("  -l <ms>      audio rendered ahead of each client (default %d)\n", ST2D_LEAD_MS);
+	printf("  -c <dir>     keep decoded modules in this cache directory\n");
+	exit(-1);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = ST2D_SOCKET;
+	struct sockaddr_un addr;
+	struct pollfd fds[ST2D_SESSIONS + 1];
+	pthread_t workers[64], loaders[ST2D_LOADERS];
+	size_t i, worker_count = ST2D_WORKERS;
+	int arg, fd, listen_fd;
+
+	for(arg = 1; arg < argc; ++arg)
+	{
+		if(argv[arg][0] != '-' || argv[arg][1] == '\0' || arg + 1 == argc)
+			usage(argv[0]);
+
+		switch(argv[arg][1])
+		{
+			case 'u':
+				path = argv[++arg];
+				break;
+			case 'w':
+				worker_count = strtoul(argv[++arg], NULL, 10);
+				break;
+			case 'l':
+				lead_ms = strtoul(argv[++arg], NULL, 10);
+				break;
+			case 'c':
+				cache_dir = argv[++arg];
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if(worker_count == 0 || worker_count > 64 || lead_ms == 0 || lead_ms > 10000 || strlen(path) >= sizeof(addr.sun_path))
+		usage(argv[0]);
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+
+	if(listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, SOMAXCONN) < 0) {
+		fprintf(stderr, "%s: can't listen on %s: %s\n", argv[0], path, strerror(errno));
+		return 1;
+	}
+
+	fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+
+	for(i = 0; i < worker_count; ++i)
+	{
+		if(pthread_create(&workers[i], NULL, worker, NULL)) {
+			fprintf(stderr, "%s: can't start worker threads\n", argv[0]);
+			return 1;
+		}
+	}
+
+	for(i = 0; i < ST2D_LOADERS; ++i)
+	{
+		if(pthread_create(&loaders[i], NULL, loader, NULL)) {
+			fprintf(stderr, "%s: can't start loader threads\n", argv[0]);
+			return 1;
+		}
+	}
+
+	while(!quit) {
+		fds[0].fd = listen_fd;
+		fds[0].events = POLLIN;
+
+		// Only the main thread adds or removes sessions, the list is stable here.
+		pthread_mutex_lock(&lock);
+		for(i = 0; i < session_count; ++i)
+		{
+			fds[i + 1].fd = sessions[i]->fd;
+			fds[i + 1].events = POLLIN;
+			if(sessions[i]->packet_pos != sessions[i]->packet_len || sessions[i]->replies_len || (sessions[i]->playing && (st2_ring_readable(&sessions[i]->ring) || (sessions[i]->ended && !sessions[i]->end_sent))))
+				fds[i + 1].events |= POLLOUT;
+		}
+		pthread_mutex_unlock(&lock);
+
+		// Workers don't signal new audio, a short timeout picks it up.
+		if(poll(fds, session_count + 1, 5) < 0 && errno != EINTR)
+			break;
+
+		for(i = session_count; i-- > 0;)
+		{
+			if(fds[i + 1].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+				session_remove(i);
+				continue;
+			}
+
+			if(((fds[i + 1].revents & POLLIN) && session_read(sessions[i]) < 0) ||
+			   ((fds[i + 1].revents & POLLOUT) && session_write(sessions[i]) < 0))
+				session_remove(i);
+		}
+
+		for(i = 0; i < session_count; ++i)
+			session_loaded(sessions[i]);
+
+		if(fds[0].revents & POLLIN) {
+			while((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+				if(session_add(fd) < 0)
+					close(fd);
+			}
+		}
+	}
+
+	pthread_mutex_lock(&lock);
+	stopping = 1;
+	pthread_cond_broadcast(&work);
+	pthread_cond_broadcast(&loads);
+	pthread_mutex_unlock(&lock);
+
+	for(i = 0; i < worker_count; ++i)
+		pthread_join(workers[i], NULL);
+
+	// A loader finishes the module it is on first.
+	for(i = 0; i < ST2D_LOADERS; ++i)
+		pthread_join(loaders[i], NULL);
+
+	// Every load left is a session's, done or still queued: removing the session frees it.
+	while(session_count)
+		session_remove(session_count - 1);
+
+	close(listen_fd);
+	unlink(path);
+
+	return 0;
+}
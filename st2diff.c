@@ -0,0 +1,730 @@
+/*
+ * st2play - very accurate C port of Scream Tracker 2.xx's replayer,
+ *
+ * Copyright 2017 Sergei "x0r" Kolzun
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * st2diff - renders modules through the reference per-sample path
+ * (st2_render_sample) and through every block renderer and mixer, and
+ * checks that they produce the same bytes, also with a memo of repeated
+ * pattern stretches attached. The first diverging frame is reported
+ * together with the channel state of both contexts at that point.
+ *
+ * With -t, each module is also rendered by that many threads at once from
+ * one shared song per loader (whole file, lazy and cached) at mixed sample
+ * rates, each thread's output checked against a single-threaded render.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "st2play.h"
+#include "stmload.h"
+
+#define DIFF_RATE      48000
+#define DIFF_FRAMES    (DIFF_RATE * 60)
+#define DIFF_CHUNK     65536
+#define DIFF_MAX_PIECE 4096
+#define DIFF_MEMO_BIG  (64 << 20)
+#define DIFF_MEMO_SMALL (256 << 10)	/* runs out part way through recording a stretch */
+
+#define PATH_U8        0
+#define PATH_S16       1
+#define PATH_F32       2
+#define PATH_U8_ST     3
+#define PATH_S16_ST    4
+#define PATH_F32_ST    5
+#define PATH_COUNT     6
+
+static const char *path_names[PATH_COUNT] = { "u8", "s16", "f32", "u8_stereo", "s16_stereo", "f32_stereo" };
+static const size_t path_sizes[PATH_COUNT] = { 1, 2, 4, 2, 4, 8 };
+static const char *mixer_names[] = { "auto", "scalar", "ssse3", "avx2", "neon" };
+static const char *loader_names[3] = { "whole", "lazy", "cached" };
+
+#define THREAD_RATES   4
+#define THREAD_PASSES  2
+
+// One thread of the shared song check; each pass starts a new context.
+typedef struct diff_thread_s {
+	pthread_t thread;
+	st2_song_t *song;
+	int loader;
+	int rate[THREAD_PASSES];	/* into thread_rates */
+	uint32_t seed;
+	uint8_t *buf;
+	uint64_t diverged[THREAD_PASSES];	/* first wrong frame, or UINT64_MAX */
+} diff_thread_t;
+
+static uint32_t seed = 1;
+static uint32_t sample_rate = DIFF_RATE;
+static uint64_t max_frames = DIFF_FRAMES;
+static uint32_t thread_count = 0;
+static uint32_t thread_rates[THREAD_RATES] = { DIFF_RATE, 22050, 15909, 44100 };
+static uint8_t *thread_expected[THREAD_RATES];
+static int threads_ready;
+static char temp_dir[] = "/tmp/st2diffXXXXXX";
+
+static uint32_t diff_rand(void);
+static void put16(uint8_t *p, uint16_t v);
+static uint8_t *generate(size_t *size);
+static size_t render_path(st2_context_t *ctx, int path, void *buf, size_t frames);
+static void expand(int path, const uint8_t *ref, void *out, size_t frames);
+static st2_context_t *start(st2_song_t *song, int mixer);
+static void dump_state(const char *label, const st2_context_t *ctx);
+static void report(const char *name, st2_song_t *song, int path, int mixer, uint64_t frame);
+static int compare(const char *name, st2_song_t *song, int path, int mixer, size_t memo_budget);
+static int check_song(const char *name, st2_song_t *song);
+static uint32_t thread_rand(uint32_t *state);
+static size_t render_all(st2_context_t *ctx, uint8_t *buf, size_t frames, uint32_t *state);
+static void *thread_main(void *arg);
+static int check_threads(const char *name, const char *filename);
+static void clear_temp_dir(void);
+
+static uint32_t diff_rand(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return seed >> 16;
+}
+
+static void put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+
+/*
+ * A random module: sample lengths and loops, compressed and plain cells,
+ * every effect with random parameters, jumps and tempo changes, and the
+ * odd note past the period table or sample with a c2spd of 0.
+ */
+static uint8_t *generate(size_t *size)
+{
+	static const uint16_t versions[4] = { 200, 210, 220, 221 };
+	static const uint16_t lengths[5] = { 50, 300, 2000, 9000, 40000 };
+	static const uint16_t c2spds[5] = { 8448, 8363, 16000, 4000, 0 };
+	static const uint8_t volumes[5] = { 64, 40, 10, 70, 0 };
+	uint8_t *data, *p;
+	uint8_t patterns = 3 + diff_rand() % 7, orders = 4 + diff_rand() % 9;
+	uint16_t version = versions[diff_rand() % 4], length[8], loop_start[8], loop_end[8];
+	size_t i, j, offset, pattern_size = 0, sample_size = 0;
+	uint8_t note, smp, vol, cmd, info, code;
+
+	for(i = 0; i < 8; ++i)
+	{
+		length[i] = lengths[diff_rand() % 5];
+		if(diff_rand() % 2) {
+			loop_start[i] = diff_rand() % (length[i] / 2);
+			loop_end[i] = loop_start[i] + 1 + diff_rand() % (length[i] - loop_start[i] + 40);
+		} else {
+			loop_start[i] = 0;
+			loop_end[i] = diff_rand() % 2 ? 0 : 0xffff;
+		}
+		sample_size += (length[i] + 15) & ~15;
+	}
+
+	// Worst case for the pattern data, every cell stored in full.
+	data = (uint8_t *)(calloc(48 + 31 * 32 + 128 + patterns * 1024 + 16 + sample_size, 1));
+	if(data == NULL)
+		return NULL;
+
+	snprintf((char *)data, 20, "fuzz %u", (unsigned)seed);
+	memcpy(data + 20, "!Scream!\x1a", 9);
+	data[29] = 2;
+	data[30] = version / 100;
+	data[31] = version % 100;
+	data[32] = version < 221 ? 6 : 0x60;
+	data[33] = patterns;
+	data[34] = diff_rand() % 2 ? 64 : 40 + diff_rand() % 41;
+
+	p = data + 48 + 31 * 32 + (version == 200 ? 64 : 128);
+	for(i = 0; i < patterns; ++i)
+	{
+		for(j = 0; j < 256; ++j)
+		{
+			code = diff_rand() % 100;
+			if(code < 25) {
+				p[pattern_size++] = 0xfb;
+				continue;
+			} else if(code < 35) {
+				p[pattern_size++] = 0xfc;
+				continue;
+			} else if(code < 38) {
+				p[pattern_size++] = 0xfd;
+				continue;
+			}
+
+			note = diff_rand() % 100 < 15 ? 254 + diff_rand() % 2 : (diff_rand() % 5) << 4 | diff_rand() % 12;
+			// 0xfb-0xfd would read as the compression codes.
+			if(diff_rand() % 50 == 0)
+				note = 80 + diff_rand() % 171;
+			smp = diff_rand() % 10;
+			vol = diff_rand() % 2 ? 65 : diff_rand() % 65;
+			cmd = diff_rand() % 16;
+			info = diff_rand();
+			if(cmd == FX_SPEED)
+				info = diff_rand() % 2 ? 0x30 + diff_rand() % 0x40 : diff_rand();
+			if(cmd == FX_POSITIONJUMP)
+				info = diff_rand() % (orders + 2);
+
+			p[pattern_size++] = note;
+			p[pattern_size++] = smp << 3 | (vol & 7);
+			p[pattern_size++] = (vol >> 3) << 4 | cmd;
+			p[pattern_size++] = info;
+		}
+	}
+
+	p = data + 48 + 31 * 32;
+	for(i = 0; i < (version == 200 ? 64 : 128); ++i)
+		p[i] = i < orders ? diff_rand() % patterns : 99;
+
+	offset = (48 + 31 * 32 + (version == 200 ? 64 : 128) + pattern_size + 15) & ~15;
+
+	for(i = 0; i < 31; ++i)
+	{
+		p = data + 48 + i * 32;
+		snprintf((char *)p, 12, "fuzz%02d.smp", (int)i + 1);
+		put16(p + 24, 8448);
+		if(i >= 8)
+			continue;
+
+		put16(p + 14, offset >> 4);
+		put16(p + 16, length[i]);
+		put16(p + 18, loop_start[i]);
+		put16(p + 20, loop_end[i]);
+		p[22] = i ? volumes[diff_rand() % 5] : 64;
+		put16(p + 24, c2spds[diff_rand() % 20 ? diff_rand() % 4 : 4]);
+
+		for(j = 0; j < length[i]; ++j)
+			data[offset + j] = diff_rand();
+		offset += (length[i] + 15) & ~15;
+	}
+
+	*size = offset;
+	return data;
+}
+
+// Renders 'frames' frames in random sized pieces, like an audio callback would.
+static size_t render_path(st2_context_t *ctx, int path, void *buf, size_t frames)
+{
+	size_t done = 0, n;
+	uint8_t *out = (uint8_t *)buf;
+
+	while(done < frames) {
+		n = diff_rand() % 8 ? 1 + diff_rand() % DIFF_MAX_PIECE : 1;
+		if(n > frames - done)
+			n = frames - done;
+
+		switch(path)
+		{
+			case PATH_U8:
+				n = st2_render_block(ctx, out != NULL ? out + done : NULL, n);
+				break;
+			case PATH_S16:
+				n = st2_render_s16(ctx, (int16_t *)(out + done * 2), n);
+				break;
+			case PATH_F32:
+				n = st2_render_f32(ctx, (float *)(out + done * 4), n);
+				break;
+			case PATH_U8_ST:
+				n = st2_render_u8_stereo(ctx, out + done * 2, n);
+				break;
+			case PATH_S16_ST:
+				n = st2_render_s16_stereo(ctx, (int16_t *)(out + done * 4), n);
+				break;
+			case PATH_F32_ST:
+				n = st2_render_f32_stereo(ctx, (float *)(out + done * 8), n);
+				break;
+		}
+
+		done += n;
+	}
+
+	return done;
+}
+
+// The reference output converted exactly as the format renderers store it.
+static void expand(int path, const uint8_t *ref, void *out, size_t frames)
+{
+	size_t i;
+	int16_t *s16 = (int16_t *)out;
+	float *f32 = (float *)out;
+	uint8_t *u8 = (uint8_t *)out;
+
+	for(i = 0; i < frames; ++i)
+	{
+		switch(path)
+		{
+			case PATH_U8:
+				u8[i] = ref[i];
+				break;
+			case PATH_S16:
+				s16[i] = (int16_t)(((int)ref[i] - 128) * 256);
+				break;
+			case PATH_F32:
+				f32[i] = ((int)ref[i] - 128) * (1.0f / 128);
+				break;
+			case PATH_U8_ST:
+				u8[i * 2] = u8[i * 2 + 1] = ref[i];
+				break;
+			case PATH_S16_ST:
+				s16[i * 2] = s16[i * 2 + 1] = (int16_t)(((int)ref[i] - 128) * 256);
+				break;
+			case PATH_F32_ST:
+				f32[i * 2] = f32[i * 2 + 1] = ((int)ref[i] - 128) * (1.0f / 128);
+				break;
+		}
+	}
+}
+
+static st2_context_t *start(st2_song_t *song, int mixer)
+{
+	st2_context_t *ctx;
+
+	if((ctx = st2_tracker_init()) == NULL)
+		return NULL;
+
+	st2_tracker_set_song(ctx, song);
+	st2_tracker_start(ctx, sample_rate);
+	st2_set_mixer(ctx, mixer);
+
+	return ctx;
+}
+
+static void dump_state(const char *label, const st2_context_t *ctx)
+{
+	size_t i;
+	const st2_channel_t *ch;
+
+	printf("  %s: order %u pattern %u tick %u/%u frame %u/%u loop %u\n", label,
+		ctx->order_current, ctx->pattern_current, ctx->current_tick, ctx->ticks_per_row,
+		ctx->current_frame, ctx->frames_per_tick, ctx->loop_count);
+
+	for(i = 0; i < 4; ++i)
+	{
+		ch = &ctx->channels[i];
+		printf("    ch%d: row %2u note %3u smp %2u cmd %x%02x period %5u pos %08x step %08x loop %5u-%5u vol %2u mix %2u data %s\n",
+			(int)i, ch->row, ch->event_note, ch->event_smp, ch->event_cmd, ch->event_infobyte,
+			ch->period_current, ctx->voices.position[i], ctx->voices.step[i], ctx->voices.loop_start[i], ctx->voices.loop_end[i],
+			ch->volume_current, ctx->voices.volume[i], ctx->voices.data[i] != NULL ? "yes" : "no");
+	}
+}
+
+// Replays both paths up to 'frame' and shows where their states part.
+static void report(const char *name, st2_song_t *song, int path, int mixer, uint64_t frame)
+{
+	st2_context_t *ref, *opt;
+	uint64_t i;
+
+	ref = start(song, ST2_MIXER_SCALAR);
+	opt = start(song, mixer);
+	if(ref == NULL || opt == NULL) {
+		st2_tracker_destroy(ref);
+		st2_tracker_destroy(opt);
+		return;
+	}
+
+	for(i = 0; i < frame; ++i)
+		st2_render_sample(ref);
+
+	// Positions only, the output up to here matched.
+	for(i = 0; i < frame; i += st2_render_block(opt, NULL, frame - i > DIFF_CHUNK ? DIFF_CHUNK : frame - i));
+
+	printf("%s: %s/%s diverges at frame %llu\n", name, path_names[path], mixer_names[mixer], (unsigned long long)frame);
+	dump_state("reference", ref);
+	dump_state(path_names[path], opt);
+
+	st2_tracker_destroy(ref);
+	st2_tracker_destroy(opt);
+}
+
+/*
+ * With a memo budget the block renderer records and replays pattern
+ * stretches; the replayed PCM has to match the reference like the rest.
+ */
+static int compare(const char *name, st2_song_t *song, int path, int mixer, size_t memo_budget)
+{
+	static uint8_t ref_buf[DIFF_CHUNK];
+	static uint8_t expected[DIFF_CHUNK * 8], actual[DIFF_CHUNK * 8];
+	st2_context_t *ref, *opt;
+	st2_memo_t *memo = NULL;
+	uint64_t frame, hash = 14695981039346656037ULL;
+	size_t i, n, size = path_sizes[path];
+	int result = 0;
+
+	ref = start(song, ST2_MIXER_SCALAR);
+	opt = start(song, mixer);
+	if(memo_budget != 0)
+		memo = st2_memo_create(memo_budget);
+	if(ref == NULL || opt == NULL || (memo_budget != 0 && memo == NULL)) {
+		st2_tracker_destroy(ref);
+		st2_tracker_destroy(opt);
+		st2_memo_destroy(memo);
+		return -1;
+	}
+	st2_set_memo(opt, memo);
+
+	for(frame = 0; frame < max_frames; frame += n)
+	{
+		n = max_frames - frame < DIFF_CHUNK ? max_frames - frame : DIFF_CHUNK;
+
+		for(i = 0; i < n; ++i)
+			ref_buf[i] = st2_render_sample(ref);
+		expand(path, ref_buf, expected, n);
+		render_path(opt, path, actual, n);
+
+		if(memcmp(expected, actual, n * size)) {
+			for(i = 0; memcmp(expected + i * size, actual + i * size, size) == 0; ++i);
+			if(memo != NULL)
+				printf("%s: %s/%s with a %zu byte memo diverges at frame %llu\n", name, path_names[path], mixer_names[mixer],
+					memo_budget, (unsigned long long)(frame + i));
+			else
+				report(name, song, path, mixer, frame + i);
+			result = 1;
+			break;
+		}
+
+		// FNV-1a of the 8-bit stream, the same for every path that matches.
+		for(i = 0; i < n; ++i)
+			hash = (hash ^ ref_buf[i]) * 1099511628211ULL;
+	}
+
+	if(result == 0 && memo != NULL)
+		printf("%s: %s/%s ok with a %zu byte memo, %llu frames, %llu replayed, hash %016llx\n", name, path_names[path], mixer_names[mixer],
+			memo_budget, (unsigned long long)max_frames, (unsigned long long)memo->frames_replayed, (unsigned long long)hash);
+	else if(result == 0)
+		printf("%s: %s/%s ok, %llu frames, hash %016llx\n", name, path_names[path], mixer_names[mixer],
+			(unsigned long long)max_frames, (unsigned long long)hash);
+
+	st2_tracker_destroy(ref);
+	st2_tracker_destroy(opt);
+	st2_memo_destroy(memo);
+
+	return result;
+}
+
+static int check_song(const char *name, st2_song_t *song)
+{
+	int path, mixer, result = 0;
+	st2_context_t *ctx;
+
+	if((ctx = st2_tracker_init()) == NULL)
+		return 1;
+
+	// Every format mixes through the selected kernel.
+	for(mixer = ST2_MIXER_SCALAR; mixer <= ST2_MIXER_NEON; ++mixer)
+	{
+		if(st2_set_mixer(ctx, mixer) < 0)
+			continue;
+		for(path = PATH_U8; path < PATH_COUNT; ++path)
+		{
+			if(compare(name, song, path, mixer, 0))
+				result = 1;
+		}
+	}
+
+	// The 8-bit stretches are copied as they are, the other formats converted.
+	if(compare(name, song, PATH_U8, ST2_MIXER_SCALAR, DIFF_MEMO_BIG) || compare(name, song, PATH_U8, ST2_MIXER_SCALAR, DIFF_MEMO_SMALL))
+		result = 1;
+	if(compare(name, song, PATH_F32_ST, ST2_MIXER_SCALAR, DIFF_MEMO_BIG) || compare(name, song, PATH_F32_ST, ST2_MIXER_SCALAR, DIFF_MEMO_SMALL))
+		result = 1;
+
+	st2_tracker_destroy(ctx);
+
+	return result;
+}
+
+static uint32_t thread_rand(uint32_t *state)
+{
+	*state = *state * 1103515245 + 12345;
+	return *state >> 16;
+}
+
+// The whole of max_frames, in random pieces when 'state' is given, past song loops.
+static size_t render_all(st2_context_t *ctx, uint8_t *buf, size_t frames, uint32_t *state)
+{
+	size_t done = 0, n;
+
+	while(done < frames) {
+		n = state != NULL ? 1 + thread_rand(state) % DIFF_MAX_PIECE : frames;
+		if(n > frames - done)
+			n = frames - done;
+		done += st2_render_block(ctx, buf + done, n);
+	}
+
+	return done;
+}
+
+static void *thread_main(void *arg)
+{
+	diff_thread_t *t = (diff_thread_t *)arg;
+	st2_context_t *ctx;
+	uint64_t i;
+	int pass;
+
+	// Start together, so the lazy fetches and rate lookups race.
+	__atomic_add_fetch(&threads_ready, 1, __ATOMIC_ACQ_REL);
+	while(__atomic_load_n(&threads_ready, __ATOMIC_ACQUIRE) < (int)thread_count);
+
+	for(pass = 0; pass < THREAD_PASSES; ++pass)
+	{
+		t->diverged[pass] = UINT64_MAX;
+		if((ctx = st2_tracker_init()) == NULL) {
+			t->diverged[pass] = 0;
+			continue;
+		}
+
+		st2_tracker_set_song(ctx, t->song);
+		st2_tracker_start(ctx, thread_rates[t->rate[pass]]);
+		render_all(ctx, t->buf, max_frames, &t->seed);
+		st2_tracker_destroy(ctx);
+
+		if(memcmp(t->buf, thread_expected[t->rate[pass]], max_frames)) {
+			for(i = 0; t->buf[i] == thread_expected[t->rate[pass]][i]; ++i);
+			t->diverged[pass] = i;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * The songs are shared by all threads, and by the references rendered
+ * first. Contexts at the same rate share a rate table, the lazy song
+ * fetches each sample for whichever thread plays it first.
+ */
+static int check_threads(const char *name, const char *filename)
+{
+	st2_song_t *songs[3], *first;
+	st2_context_t *ctx;
+	diff_thread_t *threads;
+	uint32_t i, started;
+	int rate, pass, result = 0;
+
+	songs[0] = stm_load_song(filename);
+	songs[1] = stm_load_song_lazy(filename);
+	// The first load writes the cache, the second maps it.
+	first = stm_load_song_cached(filename, temp_dir);
+	st2_song_release(first);
+	songs[2] = stm_load_song_cached(filename, temp_dir);
+
+	threads = (diff_thread_t *)(calloc(thread_count, sizeof(diff_thread_t)));
+	if(songs[0] == NULL || songs[1] == NULL || songs[2] == NULL || threads == NULL) {
+		fprintf(stderr, "%s: can't load for the thread check\n", name);
+		result = 1;
+		goto done;
+	}
+
+	thread_rates[0] = sample_rate;
+	for(rate = 0; rate < THREAD_RATES; ++rate)
+	{
+		if((thread_expected[rate] = (uint8_t *)(malloc(max_frames))) == NULL || (ctx = st2_tracker_init()) == NULL) {
+			result = 1;
+			goto done;
+		}
+		st2_tracker_set_song(ctx, songs[0]);
+		st2_tracker_start(ctx, thread_rates[rate]);
+		render_all(ctx, thread_expected[rate], max_frames, NULL);
+		st2_tracker_destroy(ctx);
+	}
+
+	threads_ready = 0;
+	for(started = 0; started < thread_count; ++started)
+	{
+		threads[started].loader = started % 3;
+		threads[started].song = songs[started % 3];
+		threads[started].rate[0] = (started / 3) % THREAD_RATES;
+		threads[started].rate[1] = (started / 3 + 1 + started % 3) % THREAD_RATES;
+		threads[started].seed = seed + started;
+		if((threads[started].buf = (uint8_t *)(malloc(max_frames))) == NULL ||
+			pthread_create(&threads[started].thread, NULL, thread_main, &threads[started])) {
+			free(threads[started].buf);
+			break;
+		}
+	}
+
+	// Threads that didn't start would leave the others waiting.
+	if(started < thread_count) {
+		fprintf(stderr, "%s: only %u of %u threads started\n", name, (unsigned)started, (unsigned)thread_count);
+		__atomic_store_n(&threads_ready, (int)thread_count, __ATOMIC_RELEASE);
+		result = 1;
+	}
+
+	for(i = 0; i < started; ++i)
+	{
+		pthread_join(threads[i].thread, NULL);
+		for(pass = 0; pass < THREAD_PASSES; ++pass)
+		{
+			if(threads[i].diverged[pass] != UINT64_MAX) {
+				printf("%s: thread %u (%s song, %u Hz) diverges at frame %llu\n", name, (unsigned)i,
+					loader_names[threads[i].loader], (unsigned)thread_rates[threads[i].rate[pass]],
+					(unsigned long long)threads[i].diverged[pass]);
+				result = 1;
+			}
+		}
+		free(threads[i].buf);
+	}
+
+	if(result == 0)
+		printf("%s: %u threads ok, %llu frames each at %u, %u, %u and %u Hz\n", name, (unsigned)thread_count,
+			(unsigned long long)max_frames, (unsigned)thread_rates[0], (unsigned)thread_rates[1],
+			(unsigned)thread_rates[2], (unsigned)thread_rates[3]);
+
+done:
+	for(rate = 0; rate < THREAD_RATES; ++rate)
+	{
+		free(thread_expected[rate]);
+		thread_expected[rate] = NULL;
+	}
+	for(i = 0; i < 3; ++i)
+		st2_song_release(songs[i]);
+	free(threads);
+	clear_temp_dir();
+
+	return result;
+}
+
+static void clear_temp_dir(void)
+{
+	DIR *dir;
+	struct dirent *de;
+	char path[sizeof(temp_dir) + 256];
+
+	if((dir = opendir(temp_dir)) == NULL)
+		return;
+
+	while((de = readdir(dir)) != NULL) {
+		if(strcmp(de->d_name, ".") && strcmp(de->d_name, "..")) {
+			snprintf(path, sizeof(path), "%s/%s", temp_dir, de->d_name);
+			unlink(path);
+		}
+	}
+
+	closedir(dir);
+}
+
+static void usage(const char *name)
+{
+	printf("usage: %s [options] [module.stm ...]\n", name);
+	printf("  -s <rate>    sample rate (default %d)\n", DIFF_RATE);
+	printf("  -f <frames>  frames compared per path (default %d)\n", DIFF_FRAMES);
+	printf("  -z <count>   also check this many random modules\n");
+	printf("  -S <seed>    first random seed (default 1)\n");
+	printf("  -t <count>   also render each module from this many threads at once\n");
+	exit(-1);
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t fuzz = 0, first_seed = 1, i;
+	uint8_t *data;
+	size_t size;
+	st2_song_t *song;
+	char name[32], path[sizeof(temp_dir) + 16];
+	FILE *fp;
+	int arg, result = 0, modules = 0;
+
+	for(arg = 1; arg < argc; ++arg)
+	{
+		if(argv[arg][0] != '-') {
+			if((song = stm_load_song(argv[arg])) == NULL) {
+				fprintf(stderr, "%s: can't load %s\n", argv[0], argv[arg]);
+				result = 1;
+				continue;
+			}
+			result |= check_song(argv[arg], song);
+			st2_song_release(song);
+			if(thread_count)
+				result |= check_threads(argv[arg], argv[arg]);
+			modules++;
+			continue;
+		}
+
+		if(argv[arg][1] == '\0' || arg + 1 == argc)
+			usage(argv[0]);
+
+		switch(argv[arg][1])
+		{
+			case 's':
+				sample_rate = strtoul(argv[++arg], NULL, 10);
+				break;
+			case 'f':
+				max_frames = strtoull(argv[++arg], NULL, 10);
+				break;
+			case 'z':
+				fuzz = strtoul(argv[++arg], NULL, 10);
+				break;
+			case 'S':
+				first_seed = strtoul(argv[++arg], NULL, 10);
+				break;
+			case 't':
+				// Holds the module cache, and the random modules the loaders read from a file.
+				if(thread_count == 0 && mkdtemp(temp_dir) == NULL) {
+					fprintf(stderr, "%s: can't create %s\n", argv[0], temp_dir);
+					return 1;
+				}
+				thread_count = strtoul(argv[++arg], NULL, 10);
+				break;
+			default:
+				usage(argv[0]);
+		}
+
+		if(sample_rate == 0 || sample_rate > 65535)
+			usage(argv[0]);
+	}
+
+	for(i = 0; i < fuzz; ++i)
+	{
+		seed = first_seed + i;
+		snprintf(name, sizeof(name), "fuzz seed %u", (unsigned)(first_seed + i));
+
+		if((data = generate(&size)) == NULL)
+			return 1;
+
+		if((song = stm_load_song_mem(data, size)) == NULL) {
+			fprintf(stderr, "%s: %s doesn't load\n", argv[0], name);
+			result = 1;
+		} else {
+			result |= check_song(name, song);
+			st2_song_release(song);
+		}
+
+		if(song != NULL && thread_count) {
+			snprintf(path, sizeof(path), "%s/fuzz.stm", temp_dir);
+			if((fp = fopen(path, "wb")) == NULL || fwrite(data, 1, size, fp) != size || fclose(fp)) {
+				fprintf(stderr, "%s: can't write %s\n", argv[0], path);
+				result = 1;
+			} else {
+				result |= check_threads(name, path);
+			}
+		}
+
+		free(data);
+		modules++;
+	}
+
+	if(thread_count)
+		rmdir(temp_dir);
+
+	if(modules == 0)
+		usage(argv[0]);
+
+	return result;
+}
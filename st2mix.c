@@ -0,0 +1,259 @@
+/*
+ * st2play - very accurate C port of Scream Tracker 2.xx's replayer,
+ *
+ * Copyright 2017 Sergei "x0r" Kolzun
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "st2play.h"
+#include "st2mix.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ST2MIX_X86
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define ST2MIX_NEON
+#include <arm_neon.h>
+#endif
+
+/*
+ * volume_table[v][s] is built with an unsigned (size_t) product, so the
+ * division by 256 rounds towards minus infinity: an arithmetic shift of the
+ * 16-bit product. The voices are summed modulo 256 like the original.
+ */
+#define ST2MIX_SCALE(v, s) ((uint8_t)(((v) * (int8_t)(s)) >> 8))
+
+/*
+ * The vector kernels mix blocks of 16 frames. A voice never moves more
+ * than 16 bytes in one at the usual steps, so its samples for the block
+ * are one unaligned 16-byte load picked apart by a byte shuffle, with no
+ * gather. Faster voices, and windows that would read past loop_end, fetch
+ * the block a byte at a time instead.
+ */
+#define ST2MIX_BLOCK 16
+
+static void mix_tail(uint8_t *buf, size_t frames, st2_voices_t *voices, size_t count);
+static int window_fits(const st2_voices_t *voices, size_t j, uint32_t position);
+static void fetch_block(uint8_t *smp, const st2_voices_t *voices, size_t j, uint32_t position);
+
+static void mix_tail(uint8_t *buf, size_t frames, st2_voices_t *voices, size_t count)
+{
+	size_t i, j;
+	uint8_t mix;
+
+	for(i = 0; i < frames; ++i)
+	{
+		mix = 128;
+		for(j = 0; j < count; ++j)
+		{
+			voices->position[j] += voices->step[j];
+			mix += ST2MIX_SCALE(voices->volume[j], voices->data[j][voices->position[j] >> 16]);
+		}
+		buf[i] = mix;
+	}
+}
+
+// Whether the block starting after 'position' can come from one 16-byte load at position >> 16.
+static int window_fits(const st2_voices_t *voices, size_t j, uint32_t position)
+{
+	return voices->step[j] < 0x10000 && (((position & 0xffff) + ST2MIX_BLOCK * voices->step[j]) >> 16) < 16 &&
+		(position >> 16) + 16 <= voices->loop_end[j];
+}
+
+static void fetch_block(uint8_t *smp, const st2_voices_t *voices, size_t j, uint32_t position)
+{
+	size_t k;
+
+	for(k = 0; k < ST2MIX_BLOCK; ++k)
+	{
+		position += voices->step[j];
+		smp[k] = voices->data[j][position >> 16];
+	}
+}
+
+#ifdef ST2MIX_X86
+// The offsets of a block's 16 samples from position >> 16, as bytes.
+#define ST2MIX_OFFSETS_X86(frac, ramp)                                                   \
+	_mm_packus_epi16(                                                                    \
+		_mm_packs_epi32(_mm_srli_epi32(_mm_add_epi32(frac, ramp[0]), 16), _mm_srli_epi32(_mm_add_epi32(frac, ramp[1]), 16)), \
+		_mm_packs_epi32(_mm_srli_epi32(_mm_add_epi32(frac, ramp[2]), 16), _mm_srli_epi32(_mm_add_epi32(frac, ramp[3]), 16)))
+
+__attribute__((target("ssse3")))
+static void mix_ssse3(uint8_t *buf, size_t frames, st2_voices_t *voices, size_t count)
+{
+	size_t i, j, k;
+	uint32_t position;
+	uint8_t tmp[ST2MIX_BLOCK];
+	__m128i ramp[4][4], vol[4], frac, smp, lo, hi;
+	const __m128i zero = _mm_setzero_si128(), mask = _mm_set1_epi16(0xff);
+
+	// Both halves of each product are the sample times 256, so mulhi is the shift by 8.
+	for(j = 0; j < count; ++j)
+	{
+		for(k = 0; k < 4; ++k)
+			ramp[j][k] = _mm_setr_epi32((4 * k + 1) * voices->step[j], (4 * k + 2) * voices->step[j],
+				(4 * k + 3) * voices->step[j], (4 * k + 4) * voices->step[j]);
+		vol[j] = _mm_set1_epi16(voices->volume[j]);
+	}
+
+	for(i = 0; i + ST2MIX_BLOCK <= frames; i += ST2MIX_BLOCK)
+	{
+		lo = hi = _mm_set1_epi16(128);
+		for(j = 0; j < count; ++j)
+		{
+			position = voices->position[j];
+			if(window_fits(voices, j, position)) {
+				frac = _mm_set1_epi32(position & 0xffff);
+				smp = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(voices->data[j] + (position >> 16))),
+					ST2MIX_OFFSETS_X86(frac, ramp[j]));
+			} else {
+				fetch_block(tmp, voices, j, position);
+				smp = _mm_loadu_si128((const __m128i *)tmp);
+			}
+			voices->position[j] = position + ST2MIX_BLOCK * voices->step[j];
+
+			lo = _mm_add_epi16(lo, _mm_mulhi_epi16(_mm_unpacklo_epi8(zero, smp), vol[j]));
+			hi = _mm_add_epi16(hi, _mm_mulhi_epi16(_mm_unpackhi_epi8(zero, smp), vol[j]));
+		}
+		_mm_storeu_si128((__m128i *)(buf + i), _mm_packus_epi16(_mm_and_si128(lo, mask), _mm_and_si128(hi, mask)));
+	}
+
+	mix_tail(buf + i, frames - i, voices, count);
+}
+
+// Two blocks at once, one in each 128-bit lane: the byte shuffle stays within its lane.
+__attribute__((target("avx2")))
+static void mix_avx2(uint8_t *buf, size_t frames, st2_voices_t *voices, size_t count)
+{
+	size_t i, j, k;
+	uint32_t position, second;
+	uint8_t tmp[2 * ST2MIX_BLOCK];
+	__m256i ramp[4][4], vol[4], frac, off, smp, lo, hi;
+	const __m256i zero = _mm256_setzero_si256(), mask = _mm256_set1_epi16(0xff);
+
+	for(j = 0; j < count; ++j)
+	{
+		for(k = 0; k < 4; ++k)
+			ramp[j][k] = _mm256_broadcastsi128_si256(_mm_setr_epi32((4 * k + 1) * voices->step[j], (4 * k + 2) * voices->step[j],
+				(4 * k + 3) * voices->step[j], (4 * k + 4) * voices->step[j]));
+		vol[j] = _mm256_set1_epi16(voices->volume[j]);
+	}
+
+	for(i = 0; i + 2 * ST2MIX_BLOCK <= frames; i += 2 * ST2MIX_BLOCK)
+	{
+		lo = hi = _mm256_set1_epi16(128);
+		for(j = 0; j < count; ++j)
+		{
+			position = voices->position[j];
+			second = position + ST2MIX_BLOCK * voices->step[j];
+			if(window_fits(voices, j, position) && window_fits(voices, j, second)) {
+				frac = _mm256_setr_epi32(position & 0xffff, position & 0xffff, position & 0xffff, position & 0xffff,
+					second & 0xffff, second & 0xffff, second & 0xffff, second & 0xffff);
+				off = _mm256_packus_epi16(
+					_mm256_packs_epi32(_mm256_srli_epi32(_mm256_add_epi32(frac, ramp[j][0]), 16), _mm256_srli_epi32(_mm256_add_epi32(frac, ramp[j][1]), 16)),
+					_mm256_packs_epi32(_mm256_srli_epi32(_mm256_add_epi32(frac, ramp[j][2]), 16), _mm256_srli_epi32(_mm256_add_epi32(frac, ramp[j][3]), 16)));
+				smp = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(voices->data[j] + (position >> 16)))),
+					_mm_loadu_si128((const __m128i *)(voices->data[j] + (second >> 16))), 1);
+				smp = _mm256_shuffle_epi8(smp, off);
+			} else {
+				fetch_block(tmp, voices, j, position);
+				fetch_block(tmp + ST2MIX_BLOCK, voices, j, second);
+				smp = _mm256_loadu_si256((const __m256i *)tmp);
+			}
+			voices->position[j] = second + ST2MIX_BLOCK * voices->step[j];
+
+			// In-lane unpacks: lo holds frames 0-7 and 16-23, hi 8-15 and 24-31, which the final pack puts back in order.
+			lo = _mm256_add_epi16(lo, _mm256_mulhi_epi16(_mm256_unpacklo_epi8(zero, smp), vol[j]));
+			hi = _mm256_add_epi16(hi, _mm256_mulhi_epi16(_mm256_unpackhi_epi8(zero, smp), vol[j]));
+		}
+		_mm256_storeu_si256((__m256i *)(buf + i), _mm256_packus_epi16(_mm256_and_si256(lo, mask), _mm256_and_si256(hi, mask)));
+	}
+
+	mix_tail(buf + i, frames - i, voices, count);
+}
+#endif
+
+#ifdef ST2MIX_NEON
+static void mix_neon(uint8_t *buf, size_t frames, st2_voices_t *voices, size_t count)
+{
+	size_t i, j, k;
+	uint32_t position, lanes[4];
+	uint8_t tmp[ST2MIX_BLOCK];
+	uint32x4_t ramp[4][4], frac;
+	uint16x8_t off_lo, off_hi;
+	int8x16_t smp;
+	int16x8_t vol[4], lo, hi;
+
+	for(j = 0; j < count; ++j)
+	{
+		for(k = 0; k < 4; ++k)
+		{
+			lanes[0] = (4 * k + 1) * voices->step[j];
+			lanes[1] = (4 * k + 2) * voices->step[j];
+			lanes[2] = (4 * k + 3) * voices->step[j];
+			lanes[3] = (4 * k + 4) * voices->step[j];
+			ramp[j][k] = vld1q_u32(lanes);
+		}
+		vol[j] = vdupq_n_s16(voices->volume[j]);
+	}
+
+	for(i = 0; i + ST2MIX_BLOCK <= frames; i += ST2MIX_BLOCK)
+	{
+		lo = hi = vdupq_n_s16(128);
+		for(j = 0; j < count; ++j)
+		{
+			position = voices->position[j];
+			if(window_fits(voices, j, position)) {
+				frac = vdupq_n_u32(position & 0xffff);
+				off_lo = vcombine_u16(vshrn_n_u32(vaddq_u32(frac, ramp[j][0]), 16), vshrn_n_u32(vaddq_u32(frac, ramp[j][1]), 16));
+				off_hi = vcombine_u16(vshrn_n_u32(vaddq_u32(frac, ramp[j][2]), 16), vshrn_n_u32(vaddq_u32(frac, ramp[j][3]), 16));
+				smp = vreinterpretq_s8_u8(vqtbl1q_u8(vld1q_u8(voices->data[j] + (position >> 16)),
+					vcombine_u8(vmovn_u16(off_lo), vmovn_u16(off_hi))));
+			} else {
+				fetch_block(tmp, voices, j, position);
+				smp = vreinterpretq_s8_u8(vld1q_u8(tmp));
+			}
+			voices->position[j] = position + ST2MIX_BLOCK * voices->step[j];
+
+			lo = vaddq_s16(lo, vshrq_n_s16(vmulq_s16(vmovl_s8(vget_low_s8(smp)), vol[j]), 8));
+			hi = vaddq_s16(hi, vshrq_n_s16(vmulq_s16(vmovl_s8(vget_high_s8(smp)), vol[j]), 8));
+		}
+		vst1q_u8(buf + i, vcombine_u8(vmovn_u16(vreinterpretq_u16_s16(lo)), vmovn_u16(vreinterpretq_u16_s16(hi))));
+	}
+
+	mix_tail(buf + i, frames - i, voices, count);
+}
+#endif
+
+st2_mix_func_t st2_mix_kernel(int mixer)
+{
+	switch(mixer)
+	{
+#ifdef ST2MIX_X86
+		case ST2_MIXER_SSSE3:
+			return __builtin_cpu_supports("ssse3") ? mix_ssse3 : NULL;
+		case ST2_MIXER_AVX2:
+			return __builtin_cpu_supports("avx2") ? mix_avx2 : NULL;
+#endif
+#ifdef ST2MIX_NEON
+		case ST2_MIXER_NEON:
+			return mix_neon;
+#endif
+		default:
+			return NULL;
+	}
+}
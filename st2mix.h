@@ -0,0 +1,25 @@
+/*
+ * st2play - very accurate C port of Scream Tracker 2.xx's replayer,
+ *
+ * Copyright 2017 Sergei "x0r" Kolzun
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ST2MIX_H
+#define ST2MIX_H
+
+// Returns the vector kernel for 'mixer' or NULL if this CPU/build can't run it.
+st2_mix_func_t st2_mix_kernel(int mixer);
+
+#endif
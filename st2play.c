@@ -20,80 +20,217 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <memory.h>
+#if defined(ST2_PROFILE) && !defined(__x86_64__) && !defined(__i386__)
+#include <time.h>
+#endif
 
 #include "st2play.h"
+#include "st2mix.h"
 
 #define ST2BASEFREQ 36072500
+#define PREFETCH_ROWS 4
+
+#ifdef ST2_PROFILE
+#define PROFILE_COUNT(ctx, field)   ((ctx)->profile.field++)
+#define PROFILE_ADD(ctx, field, n)  ((ctx)->profile.field += (n))
+#else
+#define PROFILE_COUNT(ctx, field)   ((void)0)
+#define PROFILE_ADD(ctx, field, n)  ((void)0)
+#endif
+
+// volume_table[v][s] = (v * (int8_t)s) / 256, with the product taken as size_t like the original generator.
+#define VT(v, s)      (uint8_t)(((size_t)(v) * (int8_t)(s)) / 256)
+#define VT_4(v, s)    VT(v, s), VT(v, (s) + 1), VT(v, (s) + 2), VT(v, (s) + 3)
+#define VT_16(v, s)   VT_4(v, s), VT_4(v, (s) + 4), VT_4(v, (s) + 8), VT_4(v, (s) + 12)
+#define VT_64(v, s)   VT_16(v, s), VT_16(v, (s) + 16), VT_16(v, (s) + 32), VT_16(v, (s) + 48)
+#define VT_ROW(v)     { VT_64(v, 0), VT_64(v, 64), VT_64(v, 128), VT_64(v, 192) }
+
+// 64 rows of four empty cells, as the loader expands 0xfc.
+#define ET_16(x)      x, x, x, x, x, x, x, x, x, x, x, x, x, x, x, x
+#define ET_64(x)      ET_16(x), ET_16(x), ET_16(x), ET_16(x)
+
+static const uint16_t tempo_table[18] = { 140, 50, 25, 15, 10, 7, 6, 4, 3, 3, 2, 2, 2, 2, 1, 1, 1, 1 };
+static const uint16_t period_table[80] = { 17080, 16012, 15184, 14236, 13664, 12808, 12008, 11388, 10676, 10248, 9608, 9108, 0, 0, 0, 0,
+										    8540,  8006,  7592,  7118,  6832,  6404,  6004,  5694,  5338,  5124, 4804, 4554, 0, 0, 0, 0,
+										    4270,  4003,  3796,  3559,  3416,  3202,  3002,  2847,  2669,  2562, 2402, 2277, 0, 0, 0, 0,
+										    2135,  2001,  1898,  1779,  1708,  1601,  1501,  1423,  1334,  1281, 1201, 1138, 0, 0, 0, 0,
+										    1067,  1000,   949,   889,   854,   800,   750,   711,   667,   640,  600,  569, 0, 0, 0, 0 };
+static const int16_t lfo_table[65] = {   0,   24,   49,   74,   97,  120,  141,  161,  180,  197,  212,  224,  235,  244,  250,  253,
+									   255,  253,  250,  244,  235,  224,  212,  197,  180,  161,  141,  120,   97,   74,   49,   24,
+									     0,  -24,  -49,  -74,  -97, -120, -141, -161, -180, -197, -212, -224, -235, -244, -250, -253,
+									  -255, -253, -250, -244, -235, -224, -212, -197, -180, -161, -141, -120,  -97,  -74,  -49,  -24, 0 };
+static const uint8_t volume_table[65][256] = {
+	VT_ROW(0), VT_ROW(1), VT_ROW(2), VT_ROW(3), VT_ROW(4), VT_ROW(5), VT_ROW(6), VT_ROW(7),
+	VT_ROW(8), VT_ROW(9), VT_ROW(10), VT_ROW(11), VT_ROW(12), VT_ROW(13), VT_ROW(14), VT_ROW(15),
+	VT_ROW(16), VT_ROW(17), VT_ROW(18), VT_ROW(19), VT_ROW(20), VT_ROW(21), VT_ROW(22), VT_ROW(23),
+	VT_ROW(24), VT_ROW(25), VT_ROW(26), VT_ROW(27), VT_ROW(28), VT_ROW(29), VT_ROW(30), VT_ROW(31),
+	VT_ROW(32), VT_ROW(33), VT_ROW(34), VT_ROW(35), VT_ROW(36), VT_ROW(37), VT_ROW(38), VT_ROW(39),
+	VT_ROW(40), VT_ROW(41), VT_ROW(42), VT_ROW(43), VT_ROW(44), VT_ROW(45), VT_ROW(46), VT_ROW(47),
+	VT_ROW(48), VT_ROW(49), VT_ROW(50), VT_ROW(51), VT_ROW(52), VT_ROW(53), VT_ROW(54), VT_ROW(55),
+	VT_ROW(56), VT_ROW(57), VT_ROW(58), VT_ROW(59), VT_ROW(60), VT_ROW(61), VT_ROW(62), VT_ROW(63),
+	VT_ROW(64)
+};
+static const st2_track_t empty_track = { { ET_64(255) }, { ET_64(0) }, { ET_64(65) }, { ET_64(0) }, { ET_64(0) }, { ET_64(ST2_EVENT_NONE) } };
 
-static uint16_t tempo_table[18] = { 140, 50, 25, 15, 10, 7, 6, 4, 3, 3, 2, 2, 2, 2, 1, 1, 1, 1 };
-static uint16_t period_table[80] = { 17080, 16012, 15184, 14236, 13664, 12808, 12008, 11388, 10676, 10248, 9608, 9108, 0, 0, 0, 0 };
-static int16_t lfo_table[65] = {   0,   24,   49,   74,   97,  120,  141,  161,  180,  197,  212,  224,  235,  244,  250,  253,
-								 255,  253,  250,  244,  235,  224,  212,  197,  180,  161,  141,  120,   97,   74,   49,   24,
-								   0,  -24,  -49,  -74,  -97, -120, -141, -161, -180, -197, -212, -224, -235, -244, -250, -253,
-								-255, -253, -250, -244, -235, -224, -212, -197, -180, -161, -141, -120,  -97,  -74,  -49,  -24, 0 };
-static uint8_t volume_table[65][256];
+/*
+ * Everything the tick path would otherwise divide by the sample rate for,
+ * shared by all contexts running at that rate.
+ */
+typedef struct st2_rate_s {
+	uint16_t sample_rate;
+	int refcount;
+	struct st2_rate_s *next;
+	uint16_t frames_per_tick[256];	/* by tempo byte */
+	uint32_t steps[65536];		/* by period */
+} st2_rate_t;
+
+static st2_rate_t *rates = NULL;
+static char rates_lock = 0;
 
-static void generate_period_table(void);
-static void generate_volume_table(void);
+typedef void (*mix_frames_func_t)(st2_context_t *ctx, void *out, size_t frames);
+typedef void (*copy_frames_func_t)(void *out, const uint8_t *mix, size_t frames);
 
 static void set_tempo(st2_context_t *ctx, uint8_t tempo);
 static void update_frequency(st2_context_t *ctx, size_t chn);
 static void cmd_row(st2_context_t *ctx, size_t chn);
 static void cmd_tick(st2_context_t *ctx, size_t chn);
+static uint8_t *sample_data(st2_song_t *song, size_t smp);
+static void prefetch_sample(st2_song_t *song, size_t smp);
+static void prefetch_samples(st2_context_t *ctx);
 static void trigger_note(st2_context_t *ctx, size_t chn);
 static void process_row(st2_context_t *ctx, size_t chn);
 static void change_pattern(st2_context_t *ctx);
 static void process_tick(st2_context_t *ctx);
+static void update_voices(st2_context_t *ctx);
+static uint8_t mix_sample(st2_context_t *ctx);
+static uint32_t voice_run(const st2_voices_t *voices, size_t i, uint32_t frames);
+static void mix_voices(uint8_t *buf, size_t frames, st2_voices_t *voices, size_t count);
+static uint32_t plan_run(st2_context_t *ctx, size_t frames, st2_voices_t *voices, size_t *count);
+static void mix_frames(st2_context_t *ctx, void *out, size_t frames);
+static void copy_frames(void *out, const uint8_t *mix, size_t frames);
+static uint64_t memo_hash(const st2_context_t *key);
+static void memo_key(const st2_context_t *ctx, st2_context_t *key);
+static void memo_cancel(st2_context_t *ctx);
+static void memo_segment(st2_context_t *ctx, st2_memo_t *memo);
+static int memo_frames(st2_context_t *ctx, st2_memo_t *memo, void *out, size_t frames, copy_frames_func_t copy);
+static size_t render_frames(st2_context_t *ctx, void *buf, size_t frames, size_t frame_size, mix_frames_func_t mix, copy_frames_func_t copy);
+static int add_checkpoint(st2_seek_index_t *index, uint64_t frame, const st2_context_t *state);
+static int module_owns(const st2_song_t *song, const uint8_t *ptr);
+static int decode_patterns(st2_song_t *song);
+static uint32_t frequency_step(uint16_t period, uint16_t sample_rate);
+static uint16_t tempo_frames(uint8_t tempo, uint16_t sample_rate);
+static st2_rate_t *rate_acquire(uint16_t sample_rate);
+static void rate_release(st2_rate_t *rate);
+
+#ifdef ST2_PROFILE
+static uint64_t read_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+#endif
+
+static uint16_t tempo_frames(uint8_t tempo, uint16_t sample_rate)
+{
+	return sample_rate / (49 - ((tempo_table[tempo >> 4] * (tempo & 0x0f)) >> 4));
+}
+
+static uint32_t frequency_step(uint16_t period, uint16_t sample_rate)
+{
+	uint32_t temp, step = 0;
 
-static void generate_period_table(void)
+	if(period >= 551) {
+		temp = ST2BASEFREQ / period;
+		step = ((temp / sample_rate) & 0xffff) << 16;
+		step |= (((temp % sample_rate) << 16) / sample_rate) & 0xffff;
+	}
+
+	return step;
+}
+
+static st2_rate_t *rate_acquire(uint16_t sample_rate)
 {
 	size_t i;
-	static uint8_t period_table_initialized = 0;
+	st2_rate_t *rate, *built;
+
+	for(built = NULL;;) {
+		while(__atomic_test_and_set(&rates_lock, __ATOMIC_ACQUIRE));
+		for(rate = rates; rate != NULL && rate->sample_rate != sample_rate; rate = rate->next);
+		if(rate != NULL) {
+			rate->refcount++;
+		} else if(built != NULL) {
+			rate = built;
+			rate->next = rates;
+			rates = rate;
+			built = NULL;
+		}
+		__atomic_clear(&rates_lock, __ATOMIC_RELEASE);
 
-	if(!period_table_initialized) {
-		for(i = 0; i < 64; ++i)
-			period_table[i + 16] = period_table[i] >> 1;
-		period_table_initialized = 1;
+		if(rate != NULL) {
+			// Someone else built the same rate meanwhile.
+			free(built);
+			return rate;
+		}
+
+		// Built outside the lock, it takes a while.
+		if((built = (st2_rate_t *)(malloc(sizeof(st2_rate_t)))) == NULL)
+			return NULL;
+
+		built->sample_rate = sample_rate;
+		built->refcount = 1;
+		for(i = 0; i < 256; ++i)
+			built->frames_per_tick[i] = tempo_frames(i, sample_rate);
+		for(i = 0; i < 65536; ++i)
+			built->steps[i] = frequency_step(i, sample_rate);
 	}
 }
 
-static void generate_volume_table(void)
+static void rate_release(st2_rate_t *rate)
 {
-	size_t i, j;
-	static uint8_t volume_table_initialized = 0;
+	st2_rate_t **link;
+
+	if(rate == NULL)
+		return;
 
-	if(!volume_table_initialized) {
-		for(i = 0; i < 65; ++i)
-			for(j = 0; j < 256; ++j)
-				volume_table[i][j] = (uint8_t)((i * (int8_t)j) / 256);
-		volume_table_initialized = 1;
+	while(__atomic_test_and_set(&rates_lock, __ATOMIC_ACQUIRE));
+	if(--rate->refcount == 0) {
+		for(link = &rates; *link != rate; link = &(*link)->next);
+		*link = rate->next;
+	} else {
+		rate = NULL;
 	}
+	__atomic_clear(&rates_lock, __ATOMIC_RELEASE);
+
+	free(rate);
 }
 
 static void set_tempo(st2_context_t *ctx, uint8_t tempo)
 {
 	ctx->ticks_per_row = tempo >> 4;
-	ctx->frames_per_tick = ctx->sample_rate / (49 - ((tempo_table[ctx->ticks_per_row] * (tempo & 0x0f)) >> 4));
+	ctx->frames_per_tick = ctx->rate != NULL ? ctx->rate->frames_per_tick[tempo] : tempo_frames(tempo, ctx->sample_rate);
 }
 
 static void update_frequency(st2_context_t *ctx, size_t chn)
 {
-	uint32_t temp, step = 0;
 	st2_channel_t *ch = &ctx->channels[chn];
 
-	if(ch->period_current >= 551) {
-		temp = ST2BASEFREQ / ch->period_current;
-		step = ((temp / ctx->sample_rate) & 0xffff) << 16;
-		step |= (((temp % ctx->sample_rate) << 16) / ctx->sample_rate) & 0xffff;
-	}
+	PROFILE_COUNT(ctx, frequency_updates);
 
-	ch->smp_step = step;
+	ctx->voices.step[chn] = ctx->rate != NULL ? ctx->rate->steps[ch->period_current] : frequency_step(ch->period_current, ctx->sample_rate);
 }
 
 static void cmd_row(st2_context_t *ctx, size_t chn)
 {
 	st2_channel_t *ch = &ctx->channels[chn];
 
+	PROFILE_COUNT(ctx, row_effects[ch->event_cmd]);
+
 	switch(ch->event_cmd)
 	{
 		case FX_SPEED:
@@ -113,6 +250,8 @@ static void cmd_tick(st2_context_t *ctx, size_t chn)
 {
 	st2_channel_t *ch = &ctx->channels[chn];
 
+	PROFILE_COUNT(ctx, tick_effects[ch->event_cmd]);
+
 	switch(ch->event_cmd)
 	{
 		case FX_PORTAMENTODOWN:
@@ -181,9 +320,57 @@ static void cmd_tick(st2_context_t *ctx, size_t chn)
 	}
 }
 
+// Other threads may be fetching into the same shared song.
+static uint8_t *sample_data(st2_song_t *song, size_t smp)
+{
+	uint8_t *data = __atomic_load_n(&song->samples[smp].data, __ATOMIC_ACQUIRE);
+
+	if(data == NULL && song->sample_fetch != NULL)
+		data = song->sample_fetch(song, smp);
+
+	return data;
+}
+
+static void prefetch_sample(st2_song_t *song, size_t smp)
+{
+	if(__atomic_load_n(&song->samples[smp].data, __ATOMIC_ACQUIRE) == NULL)
+		song->sample_prefetch(song, smp);
+}
+
+// Asks for the samples of the next few rows, so trigger_note's fetch rarely has to wait on the disk.
+static void prefetch_samples(st2_context_t *ctx)
+{
+	size_t i, j, row;
+	uint8_t next;
+	const st2_track_t *track;
+	st2_song_t *song = ctx->song;
+
+	for(i = 0; i < 4; ++i)
+	{
+		track = ctx->channels[i].track;
+		row = ctx->channels[i].row;
+		for(j = 0; j < PREFETCH_ROWS && row + j < 64; ++j)
+			if(track->smp[row + j])
+				prefetch_sample(song, track->smp[row + j]);
+	}
+
+	// Near the end of a pattern, peek at the start of the next one in the order list.
+	row = ctx->channels[0].row;
+	next = song->order_list_ptr[ctx->order_next & 0xff];
+	if(row + PREFETCH_ROWS <= 64 || next >= song->patterns)
+		return;
+
+	track = &song->tracks[next * 4];
+	for(i = 0; i < 4; ++i)
+		for(j = 0; j < row + PREFETCH_ROWS - 64; ++j)
+			if(track[i].smp[j])
+				prefetch_sample(song, track[i].smp[j]);
+}
+
 static void trigger_note(st2_context_t *ctx, size_t chn)
 {
 	st2_channel_t *ch = &ctx->channels[chn];
+	st2_voices_t *voices = &ctx->voices;
 
 	if(ch->event_volume != 65) {
 		ch->volume_current = ch->event_volume;
@@ -191,38 +378,40 @@ static void trigger_note(st2_context_t *ctx, size_t chn)
 	}
 
 	if(ch->event_cmd == FX_TONEPORTAMENTO) {
-		if(ch->event_note != 255)
+		if(ch->event_note < 80)
 			ch->period_target = period_table[ch->event_note];
 		return;
 	}
 
 	if(ch->event_smp != 0) {
-		ch->smp_name = ctx->samples[ch->event_smp].name;
+		ch->smp_name = ctx->song->samples[ch->event_smp].name;
 		if(ch->event_volume == 65) {
-			ch->volume_current = ctx->samples[ch->event_smp].volume & 0xff;
+			ch->volume_current = ctx->song->samples[ch->event_smp].volume & 0xff;
 			ch->volume_initial = ch->volume_current;
 		}
 
-		ch->smp_data_ptr = ctx->samples[ch->event_smp].data;
+		voices->data[chn] = sample_data(ctx->song, ch->event_smp);
 
-		if(ctx->samples[ch->event_smp].loop_end != 0xffff) {
-			ch->smp_loop_end = ctx->samples[ch->event_smp].loop_end;
-			ch->smp_loop_start = ctx->samples[ch->event_smp].loop_start;
+		if(ctx->song->samples[ch->event_smp].loop_end != 0xffff) {
+			voices->loop_end[chn] = ctx->song->samples[ch->event_smp].loop_end;
+			voices->loop_start[chn] = ctx->song->samples[ch->event_smp].loop_start;
 		} else {
-			ch->smp_loop_end = ctx->samples[ch->event_smp].length;
-			ch->smp_loop_start = 0xffff;
+			voices->loop_end[chn] = ctx->song->samples[ch->event_smp].length;
+			voices->loop_start[chn] = 0xffff;
 		}
 	}
 
 	if(ch->event_note != 255) {
-		ch->smp_position = 0;
+		voices->position[chn] = 0;
 
-		if(ch->event_note == 254) {
-			ch->smp_loop_end = 0;
-			ch->smp_loop_start = 0xffff;
+		// Past the period table the original reads beyond it, and a c2spd of 0
+		// divides by zero: both cut the voice like a note-off instead.
+		if(ch->event_note == 254 || ch->event_note >= 80 || ctx->song->samples[ch->event_smp].c2spd == 0) {
+			voices->loop_end[chn] = 0;
+			voices->loop_start[chn] = 0xffff;
 		} else {
 			ch->volume_meter = ch->volume_current >> 1;
-			ch->period_current = period_table[ch->event_note] * 8448 / ctx->samples[ch->event_smp].c2spd;
+			ch->period_current = ctx->song->note_periods[ch->event_smp][ch->event_note];
 			ch->period_target = ch->period_current;
 			update_frequency(ctx, chn);
 		}
@@ -233,25 +422,23 @@ static void trigger_note(st2_context_t *ctx, size_t chn)
 
 static void process_row(st2_context_t *ctx, size_t chn)
 {
-	uint8_t *pd;
+	size_t row;
 	st2_channel_t *ch = &ctx->channels[chn];
 
-	ch->row++;
+	row = ch->row++;
 	if(ch->row >= 64)
 		ctx->change_pattern = 1;
 
 	if(ch->on) {
-		pd = ch->pattern_data_offs;
-
-		ch->event_note =     *(pd);
-		ch->event_smp =      *(pd + 1) >> 3;
-		ch->event_volume =  (*(pd + 1) & 7) | ((*(pd + 2) >> 1) & 0x78);
-		ch->event_cmd =      *(pd + 2) & 0x0f;
-		ch->event_infobyte = *(pd + 3);
-
-		ch->pattern_data_offs += 0x10;
+		ch->event_note =     ch->track->note[row];
+		ch->event_smp =      ch->track->smp[row];
+		ch->event_volume =   ch->track->volume[row];
+		ch->event_cmd =      ch->track->cmd[row];
+		ch->event_infobyte = ch->track->infobyte[row];
+		ch->event_flags =    ch->track->flags[row];
 
-		trigger_note(ctx, chn);
+		if(!(ch->event_flags & ST2_EVENT_NONE))
+			trigger_note(ctx, chn);
 
 		if(ch->event_cmd == FX_TREMOR)
 			cmd_tick(ctx, chn);
@@ -260,22 +447,27 @@ static void process_row(st2_context_t *ctx, size_t chn)
 
 static void change_pattern(st2_context_t *ctx)
 {
-	size_t i, j;
+	size_t i;
+	const st2_track_t *track;
+	st2_song_t *song = ctx->song;
 
-	if(ctx->order_list_ptr[ctx->order_next] == 98 || ctx->order_list_ptr[ctx->order_next] == 99) {
-		ctx->order_next = ctx->order_list_ptr[ctx->order_next] == 99 ? ctx->order_first : 0;
+	if(song->order_list_ptr[ctx->order_next] == 98 || song->order_list_ptr[ctx->order_next] == 99) {
+		ctx->order_next = song->order_list_ptr[ctx->order_next] == 99 ? ctx->order_first : 0;
 		ctx->loop_count++;
 	}
 
-	ctx->pattern_current = ctx->order_list_ptr[ctx->order_next];
+	ctx->pattern_current = song->order_list_ptr[ctx->order_next];
 	// TODO: Subsong support, possible in loader.
-	// Uncomment to break song looping:
-	// ctx->order_list_ptr[ctx->order_next] = 99;
+	// Uncomment to break song looping (the song is shared between contexts):
+	// song->order_list_ptr[ctx->order_next] = 99;
 	ctx->order_current = ctx->order_next++;
 
-	for(i = 0, j = 0; i < 4; ++i, j += 4)
+	// Orders may reference patterns the module doesn't have.
+	track = ctx->pattern_current < song->patterns ? &song->tracks[ctx->pattern_current * 4] : NULL;
+
+	for(i = 0; i < 4; ++i)
 	{
-		ctx->channels[i].pattern_data_offs = ctx->pattern_data_ptr + (0x400 * ctx->pattern_current) + j;
+		ctx->channels[i].track = track != NULL ? track + i : &empty_track;
 		ctx->channels[i].row = 0;
 	}
 }
@@ -283,13 +475,28 @@ static void change_pattern(st2_context_t *ctx)
 static void process_tick(st2_context_t *ctx)
 {
 	size_t i;
+	st2_channel_t *ch;
+
+	PROFILE_COUNT(ctx, ticks);
 
 	if(ctx->current_tick != 0) {
 		ctx->current_tick--;
 		for(i = 0; i < 4; ++i)
-			cmd_tick(ctx, i);
+		{
+			ch = &ctx->channels[i];
+			if(ch->event_flags & ST2_EVENT_TICK) {
+				cmd_tick(ctx, i);
+			} else {
+				// All cmd_tick does for the other commands.
+				ch->tremor_counter = 0;
+				ch->tremor_state = 1;
+				ch->vibrato_current = 0;
+			}
+		}
 	} else {
 		if(!ctx->play_single_note) {
+			PROFILE_COUNT(ctx, rows);
+
 			if(ctx->change_pattern) {
 				ctx->change_pattern = 0;
 				change_pattern(ctx);
@@ -298,38 +505,263 @@ static void process_tick(st2_context_t *ctx)
 			for(i = 0; i < 4; ++i)
 				process_row(ctx, i);
 
+			if(ctx->song->sample_prefetch != NULL)
+				prefetch_samples(ctx);
+
 			ctx->current_tick = ctx->ticks_per_row != 0 ? ctx->ticks_per_row - 1 : 0;
 		}
 	}
 
 	for(i = 0; i < 4; ++i)
-		ctx->channels[i].volume_mix = (ctx->channels[i].volume_current * ctx->global_volume) >> 6;
+		ctx->voices.volume[i] = (ctx->channels[i].volume_current * ctx->global_volume) >> 6;
+
+	update_voices(ctx);
 }
 
-uint8_t st2_render_sample(st2_context_t *ctx)
+/*
+ * Note triggers, note-offs and volume changes only happen inside a tick, so
+ * the voice sets are rebuilt here; between ticks the mixer only ever drops
+ * a voice, when it runs off the end of a sample without a loop.
+ */
+static void update_voices(st2_context_t *ctx)
+{
+	size_t i;
+	st2_voices_t *voices = &ctx->voices;
+
+	ctx->active_voices = 0;
+	ctx->audible_voices = 0;
+
+	for(i = 0; i < 4; ++i)
+	{
+		if((voices->position[i] >> 16) >= voices->loop_end[i] && voices->loop_start[i] == 0xffff) {
+			ctx->channels[i].empty = 1;
+			continue;
+		}
+
+		ctx->active_voices |= 1 << i;
+		if(voices->data[i] != NULL && voices->volume[i] != 0 && voices->volume[i] < 65)
+			ctx->audible_voices |= 1 << i;
+	}
+}
+
+static uint8_t mix_sample(st2_context_t *ctx)
 {
 	size_t i;
 	uint8_t mix = 0;
-	st2_channel_t *ch;
+	st2_voices_t *voices = &ctx->voices;
 
 	for(i = 0; i < 4; ++i)
 	{
-		ch = &ctx->channels[i];
-		if((ch->smp_position >> 16) >= ch->smp_loop_end) {
-			if(ch->smp_loop_start != 0xffff) {
-				ch->smp_position = (ch->smp_loop_start << 16) | (ch->smp_position & 0xffff);
+		if(!(ctx->active_voices & (1 << i)))
+			continue;
+
+		if((voices->position[i] >> 16) >= voices->loop_end[i]) {
+			if(voices->loop_start[i] != 0xffff) {
+				voices->position[i] = (voices->loop_start[i] << 16) | (voices->position[i] & 0xffff);
+				PROFILE_COUNT(ctx, loop_wraps);
 			} else {
-				ch->empty = 1;
+				ctx->channels[i].empty = 1;
+				ctx->active_voices &= ~(1 << i);
+				ctx->audible_voices &= ~(1 << i);
 				continue;
 			}
 		}
 
-		ch->smp_position += ch->smp_step;
+		voices->position[i] += voices->step[i];
 
-		if(ch->smp_data_ptr != NULL && (ch->smp_position >> 16) < ch->smp_loop_end && ch->volume_mix < 65)
-			mix += volume_table[ch->volume_mix][ch->smp_data_ptr[ch->smp_position >> 16]];
+		if((ctx->audible_voices & (1 << i)) && (voices->position[i] >> 16) < voices->loop_end[i])
+			mix += volume_table[voices->volume[i]][voices->data[i][voices->position[i] >> 16]];
 	}
 
+	PROFILE_COUNT(ctx, mixed_frames[__builtin_popcount(ctx->audible_voices)]);
+
+	return mix + 128;
+}
+
+// Number of frames (up to 'frames') voice 'i' can advance before its loop-end check matters.
+static uint32_t voice_run(const st2_voices_t *voices, size_t i, uint32_t frames)
+{
+	uint32_t run;
+
+	if(voices->step[i] == 0)
+		return frames;
+
+	run = ((((uint32_t)voices->loop_end[i] << 16) - 1) - voices->position[i]) / voices->step[i];
+
+	return run < frames ? run : frames;
+}
+
+static void mix_voices(uint8_t *buf, size_t frames, st2_voices_t *voices, size_t count)
+{
+	size_t i, j;
+	uint8_t mix;
+	const uint8_t *vt[4];
+
+	for(j = 0; j < count; ++j)
+		vt[j] = volume_table[voices->volume[j]];
+
+	switch(count)
+	{
+		case 1:
+			for(i = 0; i < frames; ++i)
+			{
+				voices->position[0] += voices->step[0];
+				buf[i] = vt[0][voices->data[0][voices->position[0] >> 16]] + 128;
+			}
+			break;
+		default:
+			for(i = 0; i < frames; ++i)
+			{
+				mix = 128;
+				for(j = 0; j < count; ++j)
+				{
+					voices->position[j] += voices->step[j];
+					mix += vt[j][voices->data[j][voices->position[j] >> 16]];
+				}
+				buf[i] = mix;
+			}
+			break;
+	}
+}
+
+/*
+ * Returns how many frames can be mixed from 'voices' before any channel
+ * reaches its loop end, and advances the channels past them. The audible
+ * voices are packed into 'voices' as they stand before the run. 0 means
+ * the next frame needs the exact per-sample path (mix_sample).
+ */
+static uint32_t plan_run(st2_context_t *ctx, size_t frames, st2_voices_t *voices, size_t *count)
+{
+	size_t i;
+	uint32_t run = frames > 0x10000 ? 0x10000 : frames;
+	st2_voices_t *hot = &ctx->voices;
+
+	*count = 0;
+
+	for(i = 0; i < 4; ++i)
+	{
+		if(!(ctx->active_voices & (1 << i)))
+			continue;
+
+		if((hot->position[i] >> 16) >= hot->loop_end[i]) {
+			if(hot->loop_start[i] != 0xffff)
+				return 0;
+			ctx->channels[i].empty = 1;
+			ctx->active_voices &= ~(1 << i);
+			ctx->audible_voices &= ~(1 << i);
+			continue;
+		}
+		run = voice_run(hot, i, run);
+	}
+
+	if(run == 0)
+		return 0;
+
+	// Silent voices only move; with none audible the caller writes silence.
+	for(i = 0; i < 4; ++i)
+	{
+		if(!(ctx->active_voices & (1 << i)))
+			continue;
+
+		if(voices != NULL && (ctx->audible_voices & (1 << i))) {
+			voices->data[*count] = hot->data[i];
+			voices->position[*count] = hot->position[i];
+			voices->step[*count] = hot->step[i];
+			voices->volume[*count] = hot->volume[i];
+			voices->loop_end[*count] = hot->loop_end[i];
+			(*count)++;
+		}
+
+		hot->position[i] += run * hot->step[i];
+	}
+
+	if(voices != NULL)
+		PROFILE_ADD(ctx, mixed_frames[*count], run);
+
+	return run;
+}
+
+static void mix_frames(st2_context_t *ctx, void *out, size_t frames)
+{
+	size_t count;
+	uint32_t run;
+	uint8_t *buf = (uint8_t *)out;
+	st2_voices_t voices;
+
+	while(frames) {
+		run = plan_run(ctx, frames, buf != NULL ? &voices : NULL, &count);
+
+		// A loop wrap or a loop-end crossing is due, take the exact per-sample path.
+		if(run == 0) {
+			if(buf != NULL)
+				*buf++ = mix_sample(ctx);
+			else
+				mix_sample(ctx);
+			frames--;
+			continue;
+		}
+
+		// Without an output buffer only the sample positions advance.
+		if(buf != NULL) {
+			if(count)
+				ctx->mix_func(buf, run, &voices, count);
+			else
+				memset(buf, 128, run);
+			buf += run;
+		}
+
+		frames -= run;
+	}
+}
+
+/*
+ * Other output formats: the 8-bit mix goes through mix_frames, and so the
+ * selected kernel, a chunk at a time and is converted from there.
+ */
+#define MIX_CHUNK 512
+
+#define STORE_S16(p, m)         (p)[0] = (int16_t)(((int)(m) - 128) * 256)
+#define STORE_F32(p, m)         (p)[0] = ((int)(m) - 128) * (1.0f / 128)
+#define STORE_U8_STEREO(p, m)   (p)[0] = (p)[1] = (m)
+#define STORE_S16_STEREO(p, m)  (p)[0] = (p)[1] = (int16_t)(((int)(m) - 128) * 256)
+#define STORE_F32_STEREO(p, m)  (p)[0] = (p)[1] = ((int)(m) - 128) * (1.0f / 128)
+
+#define MIX_FORMAT(name, type, channels, STORE)                                         \
+static void copy_frames_##name(void *out, const uint8_t *mix, size_t frames)            \
+{                                                                                        \
+	size_t i;                                                                            \
+	type *buf = (type *)out;                                                             \
+                                                                                         \
+	for(i = 0; i < frames; ++i)                                                          \
+		STORE(buf + i * (channels), mix[i]);                                             \
+}                                                                                        \
+                                                                                         \
+static void mix_frames_##name(st2_context_t *ctx, void *out, size_t frames)             \
+{                                                                                        \
+	size_t n;                                                                            \
+	uint8_t mix[MIX_CHUNK];                                                              \
+	type *buf = (type *)out;                                                             \
+                                                                                         \
+	while(frames) {                                                                      \
+		n = frames < MIX_CHUNK ? frames : MIX_CHUNK;                                     \
+		mix_frames(ctx, mix, n);                                                         \
+		copy_frames_##name(buf, mix, n);                                                 \
+		buf += n * (channels);                                                           \
+		frames -= n;                                                                     \
+	}                                                                                    \
+}                                                                                        \
+                                                                                         \
+size_t st2_render_##name(st2_context_t *ctx, type *buf, size_t frames)                 \
+{                                                                                        \
+	return render_frames(ctx, buf, frames, sizeof(type) * (channels), mix_frames_##name, copy_frames_##name); \
+}
+
+uint8_t st2_render_sample(st2_context_t *ctx)
+{
+	uint8_t mix = mix_sample(ctx);
+
+	memo_cancel(ctx);
+
 	if(ctx->current_frame == 1) {
 		ctx->current_frame = ctx->frames_per_tick;
 		process_tick(ctx);
@@ -337,12 +769,450 @@ uint8_t st2_render_sample(st2_context_t *ctx)
 		ctx->current_frame--;
 	}
 
-	return mix + 128;
+	return mix;
 }
 
-st2_context_t *st2_tracker_init(void)
+static void copy_frames(void *out, const uint8_t *mix, size_t frames)
+{
+	memcpy(out, mix, frames);
+}
+
+static uint64_t memo_hash(const st2_context_t *key)
+{
+	const uint8_t *p = (const uint8_t *)key;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for(i = 0; i < sizeof(st2_context_t); ++i)
+		hash = (hash ^ p[i]) * 0x100000001b3ULL;
+
+	return hash;
+}
+
+/*
+ * The state at a pattern change, less what can't affect the audio from here
+ * on: the loop counter and position shown to the user, the mixer choice,
+ * fields only ever written, and the ones the coming row overwrites.
+ */
+static void memo_key(const st2_context_t *ctx, st2_context_t *key)
+{
+	size_t i;
+	st2_channel_t *ch;
+
+	memcpy(key, ctx, sizeof(st2_context_t));
+	key->loop_count = 0;
+	key->order_current = 0;
+	key->pattern_current = 0;
+	key->mixer = 0;
+	key->mix_func = NULL;
+	key->memo = NULL;
+#ifdef ST2_PROFILE
+	memset(&key->profile, 0, sizeof(st2_profile_t));
+#endif
+
+	for(i = 0; i < 4; ++i)
+	{
+		ch = &key->channels[i];
+		ch->empty = 0;
+		ch->row = 0;
+		ch->track = NULL;
+		ch->last_note = 0;
+		ch->smp_name = NULL;
+		ch->volume_meter = 0;
+		if(ch->on) {
+			ch->event_note = 0;
+			ch->event_volume = 0;
+			ch->event_smp = 0;
+			ch->event_cmd = 0;
+			ch->event_infobyte = 0;
+			ch->event_flags = 0;
+		}
+	}
+}
+
+static void memo_cancel(st2_context_t *ctx)
+{
+	if(ctx->memo != NULL) {
+		ctx->memo->replay = NULL;
+		ctx->memo->recording = 0;
+		ctx->memo->position = 0;
+	}
+}
+
+// Called with the next tick about to change the pattern.
+static void memo_segment(st2_context_t *ctx, st2_memo_t *memo)
+{
+	size_t i;
+	st2_memo_entry_t *entry, **entries;
+
+	if(memo->recording && memo->position != 0 && (memo->count < memo->capacity || (entries = (st2_memo_entry_t **)(realloc(memo->entries, (memo->capacity * 2 + 16) * sizeof(st2_memo_entry_t *)))) != NULL)) {
+		if(memo->count == memo->capacity) {
+			memo->entries = entries;
+			memo->capacity = memo->capacity * 2 + 16;
+		}
+		if((entry = (st2_memo_entry_t *)(malloc(sizeof(st2_memo_entry_t)))) != NULL) {
+			entry->key = memo->record_key;
+			entry->hash = memo->record_hash;
+			entry->frames = memo->position;
+			entry->pcm = memo->record;
+			memo->entries[memo->count++] = entry;
+			memo->used += sizeof(st2_memo_entry_t) + memo->position;
+			memo->record = NULL;
+			memo->record_capacity = 0;
+		}
+	}
+
+	memo->replay = NULL;
+	memo->recording = 0;
+	memo->position = 0;
+
+	memo_key(ctx, &memo->record_key);
+	memo->record_hash = memo_hash(&memo->record_key);
+
+	for(i = 0; i < memo->count; ++i)
+	{
+		entry = memo->entries[i];
+		if(entry->hash == memo->record_hash && !memcmp(&entry->key, &memo->record_key, sizeof(st2_context_t))) {
+			memo->replay = entry;
+			memo->hits++;
+			return;
+		}
+	}
+
+	memo->misses++;
+	memo->recording = memo->used + sizeof(st2_memo_entry_t) < memo->budget;
+}
+
+/*
+ * Replays or records the mix of 'frames' frames, which never cross a tick.
+ * Either way the channels still advance, so the state stays exact; only
+ * the mixing is skipped. Returns 0 if the caller has to mix itself.
+ */
+static int memo_frames(st2_context_t *ctx, st2_memo_t *memo, void *out, size_t frames, copy_frames_func_t copy)
+{
+	size_t capacity, limit;
+	uint8_t *record;
+
+	if(memo->replay != NULL) {
+		if(memo->position + frames > memo->replay->frames) {
+			memo_cancel(ctx);
+			return 0;
+		}
+		copy(out, memo->replay->pcm + memo->position, frames);
+		mix_frames(ctx, NULL, frames);
+		memo->position += frames;
+		memo->frames_replayed += frames;
+		return 1;
+	}
+
+	if(!memo->recording)
+		return 0;
+
+	if(memo->position + frames > memo->record_capacity) {
+		limit = memo->budget - memo->used - sizeof(st2_memo_entry_t);
+		capacity = memo->record_capacity * 2 > memo->position + frames ? memo->record_capacity * 2 : memo->position + frames;
+		if(capacity > limit)
+			capacity = limit;
+		if(memo->position + frames > capacity || (record = (uint8_t *)(realloc(memo->record, capacity))) == NULL) {
+			memo_cancel(ctx);
+			return 0;
+		}
+		memo->record = record;
+		memo->record_capacity = capacity;
+	}
+
+	mix_frames(ctx, memo->record + memo->position, frames);
+	copy(out, memo->record + memo->position, frames);
+	memo->position += frames;
+	return 1;
+}
+
+static size_t render_frames(st2_context_t *ctx, void *buf, size_t frames, size_t frame_size, mix_frames_func_t mix, copy_frames_func_t copy)
+{
+	size_t done = 0, left, n;
+	uint16_t loop_count = ctx->loop_count;
+	st2_memo_t *memo = buf != NULL ? ctx->memo : NULL;
+	void *out;
+#ifdef ST2_PROFILE
+	uint64_t start;
+#endif
+
+	// Frames nobody listens to can't be recorded.
+	if(memo == NULL)
+		memo_cancel(ctx);
+
+	while(done < frames) {
+		left = ctx->current_frame ? ctx->current_frame : 0x10000;
+		n = frames - done < left ? frames - done : left;
+
+		out = buf != NULL ? (uint8_t *)buf + done * frame_size : NULL;
+#ifdef ST2_PROFILE
+		start = read_cycles();
+#endif
+		if(memo == NULL || !memo_frames(ctx, memo, out, n, copy))
+			mix(ctx, out, n);
+		PROFILE_ADD(ctx, mix_cycles, read_cycles() - start);
+		done += n;
+
+		if(n == left) {
+			ctx->current_frame = ctx->frames_per_tick;
+#ifdef ST2_PROFILE
+			start = read_cycles();
+#endif
+			process_tick(ctx);
+			PROFILE_ADD(ctx, tick_cycles, read_cycles() - start);
+			if(ctx->loop_count != loop_count) {
+				memo_cancel(ctx);
+				break;
+			}
+			if(memo != NULL && ctx->current_tick == 0 && ctx->change_pattern && !ctx->play_single_note)
+				memo_segment(ctx, memo);
+		} else {
+			ctx->current_frame -= n;
+		}
+	}
+
+	return done;
+}
+
+size_t st2_render_block(st2_context_t *ctx, uint8_t *buf, size_t frames)
+{
+	return render_frames(ctx, buf, frames, 1, mix_frames, copy_frames);
+}
+
+MIX_FORMAT(s16, int16_t, 1, STORE_S16)
+MIX_FORMAT(f32, float, 1, STORE_F32)
+MIX_FORMAT(u8_stereo, uint8_t, 2, STORE_U8_STEREO)
+MIX_FORMAT(s16_stereo, int16_t, 2, STORE_S16_STEREO)
+MIX_FORMAT(f32_stereo, float, 2, STORE_F32_STEREO)
+
+static int add_checkpoint(st2_seek_index_t *index, uint64_t frame, const st2_context_t *state)
+{
+	st2_checkpoint_t *checkpoints;
+
+	if(index->count == index->capacity) {
+		checkpoints = (st2_checkpoint_t *)(realloc(index->checkpoints, (index->capacity * 2 + 16) * sizeof(st2_checkpoint_t)));
+		if(checkpoints == NULL)
+			return -1;
+		index->checkpoints = checkpoints;
+		index->capacity = index->capacity * 2 + 16;
+	}
+
+	index->checkpoints[index->count].frame = frame;
+	index->checkpoints[index->count].state = *state;
+	index->count++;
+
+	return 0;
+}
+
+st2_seek_index_t *st2_seek_index_build(const st2_context_t *ctx, uint16_t rows_per_checkpoint, uint64_t max_frames)
+{
+	st2_seek_index_t *index;
+	st2_context_t state = *ctx;
+	uint64_t frame = 0;
+	uint32_t left, rows = 0;
+	uint8_t row_tick, entering, first = 1, seen[256];
+
+	// A single note never reaches a pattern change, so it never loops.
+	if(max_frames == 0 && ctx->play_single_note)
+		return NULL;
+
+	index = (st2_seek_index_t *)(malloc(sizeof(st2_seek_index_t)));
+	if(index == NULL)
+		return NULL;
+
+	memset(index, 0, sizeof(st2_seek_index_t));
+	index->song = st2_song_ref(ctx->song);
+	state.memo = NULL;
+
+	if(rows_per_checkpoint == 0)
+		rows_per_checkpoint = 1;
+
+	if(add_checkpoint(index, 0, &state))
+		goto error;
+
+	/*
+	 * Step tick by tick, advancing the sample positions but mixing nothing.
+	 * The song has looped on a loop marker or on coming back to an order
+	 * it already played, the same end st2_analyze_timeline finds.
+	 */
+	memset(seen, 0, sizeof(seen));
+	while(max_frames == 0 || frame < max_frames) {
+		left = state.current_frame ? state.current_frame : 0x10000;
+		row_tick = state.current_tick == 0 && !state.play_single_note;
+		entering = row_tick && (state.change_pattern || first);
+		first = 0;
+
+		mix_frames(&state, NULL, left);
+		frame += left;
+
+		state.current_frame = state.frames_per_tick;
+		process_tick(&state);
+		if(state.loop_count != ctx->loop_count)
+			break;
+
+		if(entering) {
+			if(seen[state.order_current & 0xff])
+				break;
+			seen[state.order_current & 0xff] = 1;
+		}
+
+		if(row_tick && ++rows % rows_per_checkpoint == 0)
+			if(add_checkpoint(index, frame, &state))
+				goto error;
+	}
+
+	index->length = frame;
+
+	return index;
+
+error:
+	st2_seek_index_destroy(index);
+	return NULL;
+}
+
+void st2_seek_index_destroy(st2_seek_index_t *index)
+{
+	if(index != NULL) {
+		st2_song_release(index->song);
+		free(index->checkpoints);
+		free(index);
+	}
+}
+
+int st2_seek_frame(st2_context_t *ctx, const st2_seek_index_t *index, uint64_t frame)
+{
+	size_t lo = 0, hi, mid;
+	uint8_t mixer;
+	st2_mix_func_t mix_func;
+	st2_memo_t *memo;
+	st2_rate_t *rate;
+#ifdef ST2_PROFILE
+	st2_profile_t profile;
+#endif
+
+	if(index->song != ctx->song || index->count == 0)
+		return -1;
+
+	hi = index->count;
+	while(hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if(index->checkpoints[mid].frame <= frame)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	mixer = ctx->mixer;
+	mix_func = ctx->mix_func;
+	memo = ctx->memo;
+	rate = ctx->rate;
+#ifdef ST2_PROFILE
+	profile = ctx->profile;
+#endif
+	*ctx = index->checkpoints[lo].state;
+	ctx->mixer = mixer;
+	ctx->mix_func = mix_func;
+	ctx->memo = memo;
+	ctx->rate = rate;
+	if(ctx->rate != NULL && ctx->rate->sample_rate != ctx->sample_rate) {
+		rate_release(ctx->rate);
+		ctx->rate = rate_acquire(ctx->sample_rate);
+	}
+#ifdef ST2_PROFILE
+	ctx->profile = profile;
+#endif
+	memo_cancel(ctx);
+
+	frame -= index->checkpoints[lo].frame;
+	while(frame > 0)
+		frame -= render_frames(ctx, NULL, frame > 0x10000 ? 0x10000 : frame, 1, mix_frames, copy_frames);
+
+	return 0;
+}
+
+st2_memo_t *st2_memo_create(size_t budget)
+{
+	st2_memo_t *memo;
+
+	memo = (st2_memo_t *)(malloc(sizeof(st2_memo_t)));
+	if(memo == NULL)
+		return NULL;
+
+	memset(memo, 0, sizeof(st2_memo_t));
+	memo->budget = budget;
+
+	return memo;
+}
+
+void st2_memo_destroy(st2_memo_t *memo)
 {
 	size_t i;
+
+	if(memo != NULL) {
+		for(i = 0; i < memo->count; ++i)
+		{
+			free(memo->entries[i]->pcm);
+			free(memo->entries[i]);
+		}
+		free(memo->entries);
+		free(memo->record);
+		free(memo);
+	}
+}
+
+void st2_set_memo(st2_context_t *ctx, st2_memo_t *memo)
+{
+	memo_cancel(ctx);
+	ctx->memo = memo;
+	memo_cancel(ctx);
+}
+
+int st2_analyze_timeline(const st2_context_t *ctx, st2_timeline_t *timeline)
+{
+	size_t i;
+	st2_context_t state = *ctx;
+	uint64_t frame = 0;
+	uint8_t entering, first = 1;
+
+	memset(timeline, 0, sizeof(st2_timeline_t));
+	for(i = 0; i < 256; ++i)
+		timeline->order_frame[i] = ST2_TIMELINE_NEVER;
+
+	if(state.play_single_note)
+		return -1;
+
+	// Tick logic only: nothing reads the sample positions, so mixing is skipped entirely.
+	for(;;) {
+		frame += state.current_frame ? state.current_frame : 0x10000;
+		entering = state.current_tick == 0 && (state.change_pattern || first);
+		first = 0;
+
+		state.current_frame = state.frames_per_tick;
+		process_tick(&state);
+		timeline->ticks++;
+
+		if(!entering)
+			continue;
+
+		if(state.loop_count != ctx->loop_count || timeline->order_frame[state.order_current & 0xff] != ST2_TIMELINE_NEVER) {
+			timeline->length = frame;
+			timeline->loop_order = state.order_current;
+			timeline->loop_marker = state.loop_count != ctx->loop_count;
+			timeline->loop_frame = timeline->order_frame[state.order_current & 0xff];
+			if(timeline->loop_frame == ST2_TIMELINE_NEVER)
+				timeline->loop_frame = frame;
+			break;
+		}
+
+		timeline->order_frame[state.order_current & 0xff] = frame;
+	}
+
+	return 0;
+}
+
+st2_context_t *st2_tracker_init(void)
+{
 	st2_context_t *ctx;
 
 	ctx = (st2_context_t *)(malloc(sizeof(st2_context_t)));
@@ -351,41 +1221,48 @@ st2_context_t *st2_tracker_init(void)
 
 	memset(ctx, 0, sizeof(st2_context_t));
 
-	generate_volume_table();
-	generate_period_table();
-
 	ctx->tempo = 0x60;
 	ctx->global_volume = 64;
 	ctx->sample_rate = 15909;
 	ctx->frames_per_tick = ctx->current_frame = 1;
-
-	for(i = 0; i < 32; ++i)
-	{
-		ctx->samples[i].length = 0;
-		ctx->samples[i].loop_start = 0;
-		ctx->samples[i].loop_end = 0xffff;
-		ctx->samples[i].volume = 0;
-		ctx->samples[i].c2spd = 8448;
-	}
+	st2_set_mixer(ctx, ST2_MIXER_AUTO);
 
 	return ctx;
 }
 
+void st2_tracker_set_song(st2_context_t *ctx, st2_song_t *song)
+{
+	st2_song_ref(song);
+	st2_song_release(ctx->song);
+
+	ctx->song = song;
+	ctx->tempo = song->tempo;
+	ctx->global_volume = song->global_volume;
+	memo_cancel(ctx);
+}
+
 void st2_tracker_start(st2_context_t *ctx, uint16_t sample_rate)
 {
 	size_t i;
 
 	ctx->sample_rate = sample_rate ? sample_rate : 15909;
 
+	// Without the table the tick path falls back to dividing.
+	if(ctx->rate == NULL || ctx->rate->sample_rate != ctx->sample_rate) {
+		rate_release(ctx->rate);
+		ctx->rate = rate_acquire(ctx->sample_rate);
+	}
+
 	for(i = 0; i < 4; ++i)
 	{
 		ctx->channels[i].on = 1;
-		ctx->channels[i].smp_loop_start = 0xffff;
+		ctx->voices.loop_start[i] = 0xffff;
 	}
 
 	set_tempo(ctx, ctx->tempo);
 	ctx->current_frame = ctx->frames_per_tick;
 	change_pattern(ctx);
+	memo_cancel(ctx);
 }
 
 uint16_t st2_get_position(st2_context_t *ctx)
@@ -397,23 +1274,189 @@ void st2_set_position(st2_context_t *ctx, uint16_t ord)
 {
 	ctx->order_next = ctx->order_first = ord;
 	change_pattern(ctx);
+	memo_cancel(ctx);
+}
+
+int st2_set_mixer(st2_context_t *ctx, int mixer)
+{
+	st2_mix_func_t func = mix_voices;
+
+	if(mixer == ST2_MIXER_AUTO) {
+		mixer = ST2_MIXER_SCALAR;
+		if((func = st2_mix_kernel(ST2_MIXER_AVX2)) != NULL)
+			mixer = ST2_MIXER_AVX2;
+		else if((func = st2_mix_kernel(ST2_MIXER_SSSE3)) != NULL)
+			mixer = ST2_MIXER_SSSE3;
+		else if((func = st2_mix_kernel(ST2_MIXER_NEON)) != NULL)
+			mixer = ST2_MIXER_NEON;
+		else
+			func = mix_voices;
+	} else if(mixer != ST2_MIXER_SCALAR) {
+		if((func = st2_mix_kernel(mixer)) == NULL)
+			return -1;
+	}
+
+	ctx->mixer = mixer;
+	ctx->mix_func = func;
+
+	return 0;
+}
+
+int st2_get_profile(const st2_context_t *ctx, st2_profile_t *profile)
+{
+#ifdef ST2_PROFILE
+	*profile = ctx->profile;
+	return 0;
+#else
+	memset(profile, 0, sizeof(st2_profile_t));
+	return -1;
+#endif
+}
+
+int st2_reset_profile(st2_context_t *ctx)
+{
+#ifdef ST2_PROFILE
+	memset(&ctx->profile, 0, sizeof(st2_profile_t));
+	return 0;
+#else
+	return -1;
+#endif
 }
 
 void st2_tracker_destroy(st2_context_t *ctx)
+{
+	if(ctx != NULL) {
+		st2_song_release(ctx->song);
+		rate_release(ctx->rate);
+		free(ctx);
+	}
+}
+
+st2_song_t *st2_song_create(void)
 {
 	size_t i;
+	st2_song_t *song;
 
-	if(ctx != NULL) {
-		if(ctx->order_list_ptr)
-			free(ctx->order_list_ptr);
+	song = (st2_song_t *)(malloc(sizeof(st2_song_t)));
+	if(song == NULL)
+		return NULL;
 
-		if(ctx->pattern_data_ptr)
-			free(ctx->pattern_data_ptr);
+	memset(song, 0, sizeof(st2_song_t));
 
-		for(i = 0; i < 32; ++i)
-			if(ctx->samples[i].data)
-				free(ctx->samples[i].data);
+	song->refcount = 1;
+	song->tempo = 0x60;
+	song->global_volume = 64;
 
-		free(ctx);
+	for(i = 0; i < 32; ++i)
+	{
+		song->samples[i].length = 0;
+		song->samples[i].loop_start = 0;
+		song->samples[i].loop_end = 0xffff;
+		song->samples[i].volume = 0;
+		song->samples[i].c2spd = 8448;
+	}
+
+	return song;
+}
+
+static int decode_patterns(st2_song_t *song)
+{
+	size_t i, row;
+	uint8_t *pd;
+	st2_track_t *track;
+
+	song->tracks = (st2_track_t *)(malloc(sizeof(st2_track_t) * 4 * (song->patterns ? song->patterns : 1)));
+	if(song->tracks == NULL)
+		return -1;
+
+	for(i = 0; i < song->patterns * 4u; ++i)
+	{
+		track = &song->tracks[i];
+		for(row = 0; row < 64; ++row)
+		{
+			pd = song->pattern_data_ptr + 0x400 * (i >> 2) + 0x10 * row + 4 * (i & 3);
+
+			track->note[row] =     *(pd);
+			track->smp[row] =      *(pd + 1) >> 3;
+			track->volume[row] =  (*(pd + 1) & 7) | ((*(pd + 2) >> 1) & 0x78);
+			track->cmd[row] =      *(pd + 2) & 0x0f;
+			track->infobyte[row] = *(pd + 3);
+
+			track->flags[row] = 0;
+			if(track->note[row] == 255 && track->smp[row] == 0 && track->volume[row] == 65 &&
+				track->cmd[row] != FX_SPEED && track->cmd[row] != FX_POSITIONJUMP && track->cmd[row] != FX_PATTERNBREAK)
+				track->flags[row] |= ST2_EVENT_NONE;
+
+			switch(track->cmd[row])
+			{
+				case FX_VOLUMESLIDE:
+				case FX_PORTAMENTODOWN:
+				case FX_PORTAMENTOUP:
+				case FX_TONEPORTAMENTO:
+				case FX_VIBRATO:
+				case FX_TREMOR:
+					track->flags[row] |= ST2_EVENT_TICK;
+					break;
+			}
+		}
 	}
+
+	return 0;
+}
+
+int st2_song_prepare(st2_song_t *song)
+{
+	size_t i, j;
+
+	if(song->tracks == NULL && decode_patterns(song))
+		return -1;
+
+	for(i = 0; i < 32; ++i)
+		for(j = 0; j < 80; ++j)
+			song->note_periods[i][j] = song->samples[i].c2spd ? period_table[j] * 8448 / song->samples[i].c2spd : 0;
+
+	return 0;
+}
+
+st2_song_t *st2_song_ref(st2_song_t *song)
+{
+	if(song != NULL)
+		__atomic_add_fetch(&song->refcount, 1, __ATOMIC_RELAXED);
+
+	return song;
+}
+
+static int module_owns(const st2_song_t *song, const uint8_t *ptr)
+{
+	return ptr == NULL || (ptr >= song->module_data && ptr < song->module_data + song->module_size);
+}
+
+void st2_song_release(st2_song_t *song)
+{
+	size_t i;
+
+	if(song == NULL || __atomic_sub_fetch(&song->refcount, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+	// Anything that lives inside the loaded module image is not a separate allocation.
+	if(!module_owns(song, song->order_list_ptr))
+		free(song->order_list_ptr);
+
+	if(!module_owns(song, song->pattern_data_ptr))
+		free(song->pattern_data_ptr);
+
+	if(!module_owns(song, (uint8_t *)song->tracks))
+		free(song->tracks);
+
+	for(i = 0; i < 32; ++i)
+		if(!module_owns(song, song->samples[i].data))
+			free(song->samples[i].data);
+
+	if(song->module_free)
+		song->module_free(song->module_data, song->module_size);
+
+	if(song->loader_free)
+		song->loader_free(song->loader);
+
+	free(song);
 }
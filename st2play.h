@@ -36,17 +36,37 @@
 #define FX_VIBRA_VSLIDE   0x0b
 #define FX_TONE_VSLIDE    0x0f
 
+#define ST2_MIXER_AUTO    0
+#define ST2_MIXER_SCALAR  1
+#define ST2_MIXER_SSSE3   2
+#define ST2_MIXER_AVX2    3
+#define ST2_MIXER_NEON    4
+
+#define ST2_EVENT_NONE    0x01	/* nothing to do on the row: no note, sample, volume or row command */
+#define ST2_EVENT_TICK    0x02	/* the command changes the channel on every tick */
+
+// One channel of a pattern, decoded at load time.
+typedef struct st2_track_s {
+	uint8_t note[64];
+	uint8_t smp[64];
+	uint8_t volume[64];
+	uint8_t cmd[64];
+	uint8_t infobyte[64];
+	uint8_t flags[64];
+} st2_track_t;
+
 typedef struct st2_channel_s
 {
 	uint8_t on;
 	uint8_t empty;
 	uint16_t row;
-	uint8_t *pattern_data_offs;
+	const st2_track_t *track;
 	uint16_t event_note;
 	uint8_t event_volume;
 	uint16_t event_smp;
 	uint16_t event_cmd;
 	uint16_t event_infobyte;
+	uint8_t event_flags;
 	uint16_t last_note;
 	uint16_t period_current;
 	uint16_t period_target;
@@ -54,18 +74,36 @@ typedef struct st2_channel_s
 	uint16_t tremor_counter;
 	uint16_t tremor_state;
 	uint8_t *smp_name;
-	uint8_t *smp_data_ptr;
-	uint16_t smp_loop_end;
-	uint16_t smp_loop_start;
 	uint16_t smp_c2spd;
-	uint32_t smp_position;
-	uint32_t smp_step;
 	uint16_t volume_initial;
 	uint16_t volume_current;
 	uint16_t volume_meter;
-	uint16_t volume_mix;
 } st2_channel_t;
 
+// Lets the SIMD mixers load a voice field's four entries at once.
+#if defined(__GNUC__)
+#define ST2_ALIGN16 __attribute__((aligned(16)))
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define ST2_ALIGN16 _Alignas(16)
+#else
+#define ST2_ALIGN16
+#endif
+
+// What the mixer reads on every frame, one array entry per channel, kept
+// apart from the row and tick state in st2_channel_t. A voice stops when
+// its position passes loop_end and loop_start is 0xffff.
+typedef struct st2_voices_s {
+	ST2_ALIGN16 uint32_t position[4];	/* 16.16 fixed point */
+	uint32_t step[4];
+	const uint8_t *data[4];
+	uint16_t loop_end[4];
+	uint16_t loop_start[4];
+	uint16_t volume[4];	/* channel volume scaled by the global volume */
+} st2_voices_t;
+
+// Mixes 'count' voices, packed at the start of 'voices', advancing their positions.
+typedef void (*st2_mix_func_t)(uint8_t *buf, size_t frames, st2_voices_t *voices, size_t count);
+
 typedef struct st2_sample_s {
 	uint8_t name[12];
 	uint8_t id;
@@ -82,6 +120,42 @@ typedef struct st2_sample_s {
 	uint8_t *data; // !!!
 } st2_sample_t;
 
+// Immutable once loaded and shared by any number of contexts.
+typedef struct st2_song_s {
+	int refcount;
+	uint8_t tempo;
+	uint8_t global_volume;
+	uint8_t patterns;
+	uint8_t *order_list_ptr;
+	uint8_t *pattern_data_ptr;
+	st2_track_t *tracks;		/* 4 per pattern */
+	st2_sample_t samples[32];
+	uint16_t note_periods[32][80];	/* period of each note on each sample, 0 if its c2spd is 0 */
+	uint8_t *module_data;
+	size_t module_size;
+	void (*module_free)(uint8_t *data, size_t size);
+	// Lazily loaded songs: reads a sample on first use, returns NULL if it has no data.
+	// This is blocking I/O on the rendering thread, inside the tick that triggers the note.
+	uint8_t *(*sample_fetch)(struct st2_song_s *song, size_t smp);
+	// Optional, asks for a sample a few rows before it is played without waiting for it.
+	void (*sample_prefetch)(struct st2_song_s *song, size_t smp);
+	void *loader;
+	void (*loader_free)(void *loader);
+} st2_song_t;
+
+// Filled in only when everything is built with ST2_PROFILE defined.
+typedef struct st2_profile_s {
+	uint64_t ticks;
+	uint64_t rows;
+	uint64_t frequency_updates;	/* update_frequency calls, two divisions each */
+	uint64_t row_effects[16];	/* cmd_row dispatches by command */
+	uint64_t tick_effects[16];	/* cmd_tick dispatches by command */
+	uint64_t loop_wraps;
+	uint64_t mixed_frames[5];	/* frames mixed, by number of audible voices */
+	uint64_t mix_cycles;		/* TSC cycles (nanoseconds off x86) spent mixing */
+	uint64_t tick_cycles;		/* and processing ticks, in the block renderers */
+} st2_profile_t;
+
 typedef struct st2_context_s {
 	uint16_t sample_rate;
 	uint16_t pattern_current;
@@ -97,18 +171,111 @@ typedef struct st2_context_s {
 	uint8_t tempo;
 	uint8_t global_volume;
 	uint8_t play_single_note;
-	uint8_t *order_list_ptr;
-	uint8_t *pattern_data_ptr;
+	uint8_t mixer;
+	uint8_t active_voices;		/* bit per channel whose sample position still moves */
+	uint8_t audible_voices;		/* subset of active_voices that adds to the mix */
+	st2_mix_func_t mix_func;
+	struct st2_memo_s *memo;
+	struct st2_rate_s *rate;	/* steps and tick lengths for sample_rate, shared */
+	st2_song_t *song;
+	st2_voices_t voices;
 	st2_channel_t channels[4];
-	st2_sample_t samples[32];
+#ifdef ST2_PROFILE
+	st2_profile_t profile;
+#endif
 } st2_context_t;
 
-void st2_init_tables(void);
+// The mix of one stretch between pattern changes, replayed when playback
+// reaches a pattern change in the same state again.
+typedef struct st2_memo_entry_s {
+	st2_context_t key;	/* state the stretch started in, as normalized by memo_key */
+	uint64_t hash;
+	size_t frames;
+	uint8_t *pcm;
+} st2_memo_entry_t;
+
+typedef struct st2_memo_s {
+	size_t budget;		/* bytes of entries and PCM kept at most */
+	size_t used;
+	size_t count;
+	size_t capacity;
+	st2_memo_entry_t **entries;
+	st2_memo_entry_t *replay;	/* stretch being replayed, or NULL */
+	uint8_t recording;	/* 1 = mixing into 'record' for a new entry */
+	size_t position;		/* frames into the stretch */
+	st2_context_t record_key;
+	uint64_t record_hash;
+	uint8_t *record;
+	size_t record_capacity;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t frames_replayed;
+} st2_memo_t;
+
+#define ST2_TIMELINE_NEVER UINT64_MAX
+
+// Frames are counted from the state the context is in when analyzed, an
+// order's frame is the one its first row is processed at.
+typedef struct st2_timeline_s {
+	uint64_t length;		/* frames until the song repeats */
+	uint64_t loop_frame;		/* frame playback continues from after 'length' */
+	uint16_t loop_order;		/* order playback continues from after 'length' */
+	uint8_t loop_marker;		/* 1 = order 98/99 marker, 0 = position jump */
+	uint64_t ticks;			/* ticks processed to find all this */
+	uint64_t order_frame[256];	/* first time each order is reached, or ST2_TIMELINE_NEVER */
+} st2_timeline_t;
+
+typedef struct st2_checkpoint_s {
+	uint64_t frame;
+	st2_context_t state;
+} st2_checkpoint_t;
+
+typedef struct st2_seek_index_s {
+	st2_song_t *song;
+	uint64_t length;
+	size_t count;
+	size_t capacity;
+	st2_checkpoint_t *checkpoints;
+} st2_seek_index_t;
+
+st2_song_t *st2_song_create(void);
+st2_song_t *st2_song_ref(st2_song_t *song);
+void st2_song_release(st2_song_t *song);
+// Loaders call this once the sample headers and expanded patterns are in
+// place: decodes the patterns into tracks unless the loader provided them,
+// and works out every sample's note periods.
+int st2_song_prepare(st2_song_t *song);
 st2_context_t *st2_tracker_init(void);
+void st2_tracker_set_song(st2_context_t *ctx, st2_song_t *song);
 void st2_tracker_start(st2_context_t *ctx, uint16_t sample_rate);
 void st2_tracker_destroy(st2_context_t *ctx);
 uint16_t st2_get_position(st2_context_t *ctx);
 void st2_set_position(st2_context_t *ctx, uint16_t ord);
+int st2_set_mixer(st2_context_t *ctx, int mixer);
+// Both return -1 when built without ST2_PROFILE.
+int st2_get_profile(const st2_context_t *ctx, st2_profile_t *profile);
+int st2_reset_profile(st2_context_t *ctx);
 uint8_t st2_render_sample(st2_context_t *ctx);
+// Renders up to 'frames' samples, stopping early right after the song loops.
+size_t st2_render_block(st2_context_t *ctx, uint8_t *buf, size_t frames);
+// Same, writing signed 16-bit or [-1, 1) float, mono or with the mix on both channels.
+size_t st2_render_s16(st2_context_t *ctx, int16_t *buf, size_t frames);
+size_t st2_render_f32(st2_context_t *ctx, float *buf, size_t frames);
+size_t st2_render_u8_stereo(st2_context_t *ctx, uint8_t *buf, size_t frames);
+size_t st2_render_s16_stereo(st2_context_t *ctx, int16_t *buf, size_t frames);
+size_t st2_render_f32_stereo(st2_context_t *ctx, float *buf, size_t frames);
+
+// Frame 0 of the index is the state 'ctx' is in when it is built; the build
+// runs until the song loops, at the frame st2_analyze_timeline gives as its
+// length, or 'max_frames' (0 = no limit) have passed.
+st2_seek_index_t *st2_seek_index_build(const st2_context_t *ctx, uint16_t rows_per_checkpoint, uint64_t max_frames);
+void st2_seek_index_destroy(st2_seek_index_t *index);
+int st2_seek_frame(st2_context_t *ctx, const st2_seek_index_t *index, uint64_t frame);
+int st2_analyze_timeline(const st2_context_t *ctx, st2_timeline_t *timeline);
+
+// A memo serves one context at a time and is only used by the st2_render_* block functions.
+st2_memo_t *st2_memo_create(size_t budget);
+void st2_memo_destroy(st2_memo_t *memo);
+void st2_set_memo(st2_context_t *ctx, st2_memo_t *memo);
 
 #endif
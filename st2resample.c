@@ -0,0 +1,156 @@
+/*
+ * st2play - very accurate C port of Scream Tracker 2.xx's replayer,
+ *
+ * Copyright 2017 Sergei "x0r" Kolzun
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "st2resample.h"
+
+#define PHASE_SHIFT   (32 - 8)	/* log2(ST2_RESAMPLE_PHASES) */
+#define HALF          (ST2_RESAMPLE_TAPS / 2)
+
+static double kernel(double x, double cutoff);
+static float filter(const st2_resampler_t *rs, const float *in, uint32_t frac);
+
+// Blackman windowed sinc, 'cutoff' in cycles per input frame.
+static double kernel(double x, double cutoff)
+{
+	double s, w;
+
+	if(fabs(x) >= HALF)
+		return 0;
+
+	s = x == 0 ? 2 * cutoff : sin(2 * M_PI * cutoff * x) / (M_PI * x);
+	w = 0.42 + 0.5 * cos(M_PI * x / HALF) + 0.08 * cos(2 * M_PI * x / HALF);
+
+	return s * w;
+}
+
+static float filter(const st2_resampler_t *rs, const float *in, uint32_t frac)
+{
+	size_t k, phase = frac >> PHASE_SHIFT;
+	float f = (frac & ((1u << PHASE_SHIFT) - 1)) * (1.0f / (1u << PHASE_SHIFT));
+	const st2_v4f_t *c = rs->coefs + phase * (ST2_RESAMPLE_TAPS / 4);
+	const st2_v4f_t *d = rs->deltas + phase * (ST2_RESAMPLE_TAPS / 4);
+	st2_v4f_t x, acc = { 0, 0, 0, 0 }, mu = { f, f, f, f };
+
+	for(k = 0; k < ST2_RESAMPLE_TAPS / 4; ++k)
+	{
+		memcpy(&x, in + k * 4, sizeof(x));
+		acc += x * (c[k] + mu * d[k]);
+	}
+
+	return acc[0] + acc[1] + acc[2] + acc[3];
+}
+
+st2_resampler_t *st2_resampler_create(uint32_t in_rate, uint32_t out_rate)
+{
+	st2_resampler_t *rs;
+	float coefs[ST2_RESAMPLE_TAPS];
+	double cutoff, sum;
+	size_t p, k;
+
+	if(in_rate == 0 || out_rate == 0)
+		return NULL;
+
+	rs = (st2_resampler_t *)(malloc(sizeof(st2_resampler_t)));
+	if(rs == NULL)
+		return NULL;
+
+	memset(rs, 0, sizeof(st2_resampler_t));
+
+	// Band edge just below the lower of the two Nyquist frequencies.
+	cutoff = 0.45 * (in_rate < out_rate ? in_rate : out_rate) / in_rate;
+
+	// Phase p filters an output frame p/PHASES past tap HALF - 1, normalized for unity gain.
+	for(p = 0; p <= ST2_RESAMPLE_PHASES; ++p)
+	{
+		sum = 0;
+		for(k = 0; k < ST2_RESAMPLE_TAPS; ++k)
+			sum += kernel((double)k - (HALF - 1) - (double)p / ST2_RESAMPLE_PHASES, cutoff);
+
+		for(k = 0; k < ST2_RESAMPLE_TAPS; ++k)
+		{
+			coefs[k] = kernel((double)k - (HALF - 1) - (double)p / ST2_RESAMPLE_PHASES, cutoff) / sum;
+			rs->coefs[p * (ST2_RESAMPLE_TAPS / 4) + k / 4][k % 4] = coefs[k];
+			if(p != 0)
+				rs->deltas[(p - 1) * (ST2_RESAMPLE_TAPS / 4) + k / 4][k % 4] = coefs[k] - rs->coefs[(p - 1) * (ST2_RESAMPLE_TAPS / 4) + k / 4][k % 4];
+		}
+	}
+
+	rs->step = ((uint64_t)in_rate << 32) / out_rate;
+
+	// Silence ahead of the first input frame, the first output frame is centred on it.
+	rs->count = HALF - 1;
+
+	return rs;
+}
+
+void st2_resampler_destroy(st2_resampler_t *rs)
+{
+	free(rs);
+}
+
+size_t st2_resample(st2_resampler_t *rs, const float *in, size_t *in_frames, float *out, size_t out_frames)
+{
+	size_t base, drop, n, consumed = 0, done = 0;
+
+	while(done < out_frames) {
+		base = rs->position >> 32;
+
+		if(base + ST2_RESAMPLE_TAPS > rs->count) {
+			if(consumed == *in_frames)
+				break;
+
+			// Drop what no later frame can reach and top up from the input.
+			drop = base < rs->count ? base : rs->count;
+			memmove(rs->history, rs->history + drop, (rs->count - drop) * sizeof(float));
+			rs->count -= drop;
+			rs->position -= (uint64_t)drop << 32;
+
+			n = ST2_RESAMPLE_BUFFER - rs->count;
+			if(n > *in_frames - consumed)
+				n = *in_frames - consumed;
+			memcpy(rs->history + rs->count, in + consumed, n * sizeof(float));
+			rs->count += n;
+			consumed += n;
+			continue;
+		}
+
+		out[done++] = filter(rs, rs->history + base, (uint32_t)rs->position);
+		rs->position += rs->step;
+	}
+
+	*in_frames = consumed;
+
+	return done;
+}
+
+// Half a filter of silence centres the last output frames on the last input frame.
+size_t st2_resample_flush(st2_resampler_t *rs, float *out, size_t out_frames)
+{
+	static const float silence[HALF];
+	size_t in = HALF - rs->flushed, done;
+
+	done = st2_resample(rs, silence, &in, out, out_frames);
+	rs->flushed += in;
+
+	return done;
+}
@@ -0,0 +1,52 @@
+/*
+ * st2play - very accurate C port of Scream Tracker 2.xx's replayer,
+ *
+ * Copyright 2017 Sergei "x0r" Kolzun
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ST2RESAMPLE_H
+#define ST2RESAMPLE_H
+
+/*
+ * Polyphase FIR resampler for mono float streams: lets the replayer run at
+ * a low native rate (e.g. 15909 Hz) and still feed a 48 or 96 kHz device.
+ * The filter is a 16-tap windowed sinc with 256 phases, the fractional
+ * phase in between interpolated linearly.
+ */
+
+#define ST2_RESAMPLE_TAPS   16
+#define ST2_RESAMPLE_PHASES 256
+#define ST2_RESAMPLE_BUFFER 4096
+
+typedef float st2_v4f_t __attribute__((vector_size(16)));
+
+typedef struct st2_resampler_s {
+	st2_v4f_t coefs[(ST2_RESAMPLE_PHASES + 1) * ST2_RESAMPLE_TAPS / 4];
+	st2_v4f_t deltas[ST2_RESAMPLE_PHASES * ST2_RESAMPLE_TAPS / 4];
+	uint64_t step;		/* input frames per output frame, 32.32 */
+	uint64_t position;	/* of the next output frame in 'history', 32.32 */
+	size_t count;		/* input frames in 'history' */
+	size_t flushed;		/* silent frames fed by st2_resample_flush */
+	float history[ST2_RESAMPLE_BUFFER];
+} st2_resampler_t;
+
+st2_resampler_t *st2_resampler_create(uint32_t in_rate, uint32_t out_rate);
+void st2_resampler_destroy(st2_resampler_t *rs);
+// Converts up to 'out_frames' frames, '*in_frames' is updated to the number of input frames consumed.
+size_t st2_resample(st2_resampler_t *rs, const float *in, size_t *in_frames, float *out, size_t out_frames);
+// After the last input: returns the frames still held back by the filter, 0 once they are all out.
+size_t st2_resample_flush(st2_resampler_t *rs, float *out, size_t out_frames);
+
+#endif
@@ -0,0 +1,113 @@
+/*
+ * st2play - very accurate C port of Scream Tracker 2.xx's replayer,
+ *
+ * Copyright 2017 Sergei "x0r" Kolzun
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "st2ring.h"
+
+/*
+ * read_pos and write_pos only ever grow (modulo SIZE_MAX + 1); each side
+ * publishes its own counter with a release store and reads the other's
+ * with an acquire load, so the copied bytes are visible before the counter.
+ */
+
+int st2_ring_init(st2_ring_t *ring, size_t size)
+{
+	size_t pow2 = 1;
+
+	while(pow2 < size)
+		pow2 <<= 1;
+
+	ring->data = (uint8_t *)(malloc(pow2));
+	if(ring->data == NULL)
+		return -1;
+
+	ring->size = pow2;
+	ring->read_pos = 0;
+	ring->write_pos = 0;
+
+	return 0;
+}
+
+void st2_ring_free(st2_ring_t *ring)
+{
+	free(ring->data);
+	ring->data = NULL;
+}
+
+size_t st2_ring_readable(st2_ring_t *ring)
+{
+	size_t read_pos, write_pos;
+
+	// read_pos first: it can never pass a write_pos loaded after it
+	read_pos = __atomic_load_n(&ring->read_pos, __ATOMIC_ACQUIRE);
+	write_pos = __atomic_load_n(&ring->write_pos, __ATOMIC_ACQUIRE);
+
+	return write_pos - read_pos;
+}
+
+size_t st2_ring_writable(st2_ring_t *ring)
+{
+	return ring->size - st2_ring_readable(ring);
+}
+
+size_t st2_ring_write(st2_ring_t *ring, const void *src, size_t len)
+{
+	size_t pos, part, read_pos;
+
+	pos = ring->write_pos;
+	read_pos = __atomic_load_n(&ring->read_pos, __ATOMIC_ACQUIRE);
+
+	if(len > ring->size - (pos - read_pos))
+		len = ring->size - (pos - read_pos);
+
+	part = ring->size - (pos & (ring->size - 1));
+	if(part > len)
+		part = len;
+
+	memcpy(ring->data + (pos & (ring->size - 1)), src, part);
+	memcpy(ring->data, (const uint8_t *)src + part, len - part);
+
+	__atomic_store_n(&ring->write_pos, pos + len, __ATOMIC_RELEASE);
+
+	return len;
+}
+
+size_t st2_ring_read(st2_ring_t *ring, void *dst, size_t len)
+{
+	size_t pos, part, write_pos;
+
+	pos = ring->read_pos;
+	write_pos = __atomic_load_n(&ring->write_pos, __ATOMIC_ACQUIRE);
+
+	if(len > write_pos - pos)
+		len = write_pos - pos;
+
+	part = ring->size - (pos & (ring->size - 1));
+	if(part > len)
+		part = len;
+
+	memcpy(dst, ring->data + (pos & (ring->size - 1)), part);
+	memcpy((uint8_t *)dst + part, ring->data, len - part);
+
+	__atomic_store_n(&ring->read_pos, pos + len, __ATOMIC_RELEASE);
+
+	return len;
+}
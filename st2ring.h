@@ -0,0 +1,37 @@
+/*
+ * st2play - very accurate C port of Scream Tracker 2.xx's replayer,
+ *
+ * Copyright 2017 Sergei "x0r" Kolzun
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ST2RING_H
+#define ST2RING_H
+
+// Lock-free ring buffer for exactly one producer and one consumer thread.
+typedef struct st2_ring_s {
+	uint8_t *data;
+	size_t size;		/* power of two */
+	size_t read_pos;	/* only written by the consumer */
+	size_t write_pos;	/* only written by the producer */
+} st2_ring_t;
+
+int st2_ring_init(st2_ring_t *ring, size_t size);
+void st2_ring_free(st2_ring_t *ring);
+size_t st2_ring_readable(st2_ring_t *ring);
+size_t st2_ring_writable(st2_ring_t *ring);
+size_t st2_ring_write(st2_ring_t *ring, const void *src, size_t len);
+size_t st2_ring_read(st2_ring_t *ring, void *dst, size_t len);
+
+#endif
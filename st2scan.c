@@ -0,0 +1,431 @@
+/*
+ * st2play - very accurate C port of Scream Tracker 2.xx's replayer,
+ *
+ * Copyright 2017 Sergei "x0r" Kolzun
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * st2scan - walks directory trees for STM files and writes an index of
+ * them as JSON lines, one object per file, sorted by path. Only the file
+ * header and sample headers are read, a few threads reading at once.
+ *
+ * Paths are written as they are when they are valid UTF-8, and as
+ * "path_hex", the bytes in hex, when they are not, so every entry maps
+ * back to its file. Song and sample names are taken as CP437, the DOS
+ * code page the trackers used, and converted to UTF-8.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "st2play.h"
+#include "stmload.h"
+
+#define SCAN_THREADS  8
+#define SCAN_HEADERS  (48 + 31 * 32)
+
+typedef struct scan_entry_s {
+	char *path;
+	int status;		/* 0, an STM_* header code, or SCAN_UNREADABLE */
+	uint64_t size;
+	stm_header_t header;
+	uint8_t samples[31 * 32];
+} scan_entry_t;
+
+#define SCAN_UNREADABLE -100
+
+// Unicode for CP437 0x80-0xff.
+static const uint16_t cp437[128] = {
+	0x00c7, 0x00fc, 0x00e9, 0x00e2, 0x00e4, 0x00e0, 0x00e5, 0x00e7,
+	0x00ea, 0x00eb, 0x00e8, 0x00ef, 0x00ee, 0x00ec, 0x00c4, 0x00c5,
+	0x00c9, 0x00e6, 0x00c6, 0x00f4, 0x00f6, 0x00f2, 0x00fb, 0x00f9,
+	0x00ff, 0x00d6, 0x00dc, 0x00a2, 0x00a3, 0x00a5, 0x20a7, 0x0192,
+	0x00e1, 0x00ed, 0x00f3, 0x00fa, 0x00f1, 0x00d1, 0x00aa, 0x00ba,
+	0x00bf, 0x2310, 0x00ac, 0x00bd, 0x00bc, 0x00a1, 0x00ab, 0x00bb,
+	0x2591, 0x2592, 0x2593, 0x2502, 0x2524, 0x2561, 0x2562, 0x2556,
+	0x2555, 0x2563, 0x2551, 0x2557, 0x255d, 0x255c, 0x255b, 0x2510,
+	0x2514, 0x2534, 0x252c, 0x251c, 0x2500, 0x253c, 0x255e, 0x255f,
+	0x255a, 0x2554, 0x2569, 0x2566, 0x2560, 0x2550, 0x256c, 0x2567,
+	0x2568, 0x2564, 0x2565, 0x2559, 0x2558, 0x2552, 0x2553, 0x256b,
+	0x256a, 0x2518, 0x250c, 0x2588, 0x2584, 0x258c, 0x2590, 0x2580,
+	0x03b1, 0x00df, 0x0393, 0x03c0, 0x03a3, 0x03c3, 0x00b5, 0x03c4,
+	0x03a6, 0x0398, 0x03a9, 0x03b4, 0x221e, 0x03c6, 0x03b5, 0x2229,
+	0x2261, 0x00b1, 0x2265, 0x2264, 0x2320, 0x2321, 0x00f7, 0x2248,
+	0x00b0, 0x2219, 0x00b7, 0x221a, 0x207f, 0x00b2, 0x25a0, 0x00a0
+};
+
+static scan_entry_t *entries = NULL;
+static size_t entry_count = 0;
+static size_t entry_capacity = 0;
+static size_t next_entry = 0;
+
+static int add_path(const char *path);
+static int walk(const char *path, int root);
+static void scan(scan_entry_t *entry);
+static void *worker(void *arg);
+static int compare_entries(const void *a, const void *b);
+static size_t utf8_length(const uint8_t *s);
+static void put_char(FILE *fp, uint32_t c);
+static void put_path(FILE *fp, const char *path);
+static void put_name(FILE *fp, const uint8_t *s, size_t max);
+static void put_entry(FILE *fp, const scan_entry_t *entry);
+static void usage(const char *name);
+
+static int add_path(const char *path)
+{
+	scan_entry_t *grown;
+
+	if(entry_count == entry_capacity) {
+		grown = (scan_entry_t *)(realloc(entries, (entry_capacity * 2 + 256) * sizeof(scan_entry_t)));
+		if(grown == NULL)
+			return -1;
+		entries = grown;
+		entry_capacity = entry_capacity * 2 + 256;
+	}
+
+	memset(&entries[entry_count], 0, sizeof(scan_entry_t));
+	if((entries[entry_count].path = strdup(path)) == NULL)
+		return -1;
+	entry_count++;
+
+	return 0;
+}
+
+/*
+ * Directory listing is cheap next to reading, so it stays on one thread.
+ * Symlinks to files are indexed, symlinks to directories are only followed
+ * when given on the command line, so a link back up the tree can't loop.
+ * Returns -1 when out of memory.
+ */
+static int walk(const char *path, int root)
+{
+	DIR *dir;
+	struct dirent *de;
+	struct stat st;
+	char *child;
+	size_t len;
+	int ret = 0, link;
+
+	if(lstat(path, &st) < 0)
+		return 0;
+
+	link = S_ISLNK(st.st_mode);
+	if(link && stat(path, &st) < 0)
+		return 0;
+
+	if(!S_ISDIR(st.st_mode)) {
+		len = strlen(path);
+		if(S_ISREG(st.st_mode) && len >= 4 && !strcasecmp(path + len - 4, ".stm"))
+			return add_path(path);
+		return 0;
+	}
+
+	if((link && !root) || (dir = opendir(path)) == NULL)
+		return 0;
+
+	while(ret == 0 && (de = readdir(dir)) != NULL) {
+		if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		if((child = (char *)(malloc(strlen(path) + strlen(de->d_name) + 2))) == NULL) {
+			ret = -1;
+			break;
+		}
+		sprintf(child, "%s/%s", path, de->d_name);
+		ret = walk(child, 0);
+		free(child);
+	}
+
+	closedir(dir);
+
+	return ret;
+}
+
+static void scan(scan_entry_t *entry)
+{
+	int fd;
+	struct stat st;
+	uint8_t data[SCAN_HEADERS];
+	ssize_t len;
+
+	if((fd = open(entry->path, O_RDONLY)) < 0) {
+		entry->status = SCAN_UNREADABLE;
+		return;
+	}
+
+	if(fstat(fd, &st) < 0 || (len = pread(fd, data, SCAN_HEADERS, 0)) < 0) {
+		entry->status = SCAN_UNREADABLE;
+		close(fd);
+		return;
+	}
+
+	close(fd);
+
+	// A short file leaves the missing sample headers empty.
+	if(len < SCAN_HEADERS)
+		memset(data + len, 0, SCAN_HEADERS - len);
+
+	entry->size = st.st_size;
+	entry->status = stm_read_header(data, len, &entry->header);
+	memcpy(entry->samples, data + 48, sizeof(entry->samples));
+}
+
+static void *worker(void *arg)
+{
+	size_t i;
+
+	while((i = __atomic_fetch_add(&next_entry, 1, __ATOMIC_RELAXED)) < entry_count)
+		scan(&entries[i]);
+
+	return NULL;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+	return strcmp(((const scan_entry_t *)a)->path, ((const scan_entry_t *)b)->path);
+}
+
+// Length of the UTF-8 sequence at 's', 0 if it isn't one: overlong forms and surrogates are rejected.
+static size_t utf8_length(const uint8_t *s)
+{
+	size_t i, len;
+	uint32_t c;
+
+	if(s[0] < 0x80)
+		return 1;
+	else if(s[0] >= 0xc2 && s[0] < 0xe0)
+		len = 2, c = s[0] & 0x1f;
+	else if(s[0] >= 0xe0 && s[0] < 0xf0)
+		len = 3, c = s[0] & 0x0f;
+	else if(s[0] >= 0xf0 && s[0] < 0xf5)
+		len = 4, c = s[0] & 0x07;
+	else
+		return 0;
+
+	for(i = 1; i < len; ++i)
+	{
+		if((s[i] & 0xc0) != 0x80)
+			return 0;
+		c = (c << 6) | (s[i] & 0x3f);
+	}
+
+	if((len == 3 && (c < 0x800 || (c >= 0xd800 && c < 0xe000))) || (len == 4 && (c < 0x10000 || c > 0x10ffff)))
+		return 0;
+
+	return len;
+}
+
+// One code point inside a JSON string: only '"', '\' and control characters are escaped.
+static void put_char(FILE *fp, uint32_t c)
+{
+	if(c == '"' || c == '\\') {
+		fprintf(fp, "\\%c", c);
+	} else if(c < 0x20) {
+		fprintf(fp, "\\u%04x", c);
+	} else if(c < 0x80) {
+		fputc(c, fp);
+	} else if(c < 0x800) {
+		fputc(0xc0 | (c >> 6), fp);
+		fputc(0x80 | (c & 0x3f), fp);
+	} else {
+		fputc(0xe0 | (c >> 12), fp);
+		fputc(0x80 | ((c >> 6) & 0x3f), fp);
+		fputc(0x80 | (c & 0x3f), fp);
+	}
+}
+
+static void put_path(FILE *fp, const char *path)
+{
+	const uint8_t *p = (const uint8_t *)path;
+	size_t i, len;
+
+	for(i = 0; p[i] != '\0'; i += len)
+	{
+		if((len = utf8_length(p + i)) == 0)
+			break;
+	}
+
+	if(p[i] != '\0') {
+		fputs("\"path_hex\": \"", fp);
+		for(i = 0; p[i] != '\0'; ++i)
+			fprintf(fp, "%02x", p[i]);
+		fputc('"', fp);
+		return;
+	}
+
+	fputs("\"path\": \"", fp);
+	for(i = 0; p[i] != '\0'; i += len)
+	{
+		len = utf8_length(p + i);
+		if(len == 1)
+			put_char(fp, p[i]);
+		else
+			fwrite(p + i, 1, len, fp);
+	}
+	fputc('"', fp);
+}
+
+static void put_name(FILE *fp, const uint8_t *s, size_t max)
+{
+	size_t i;
+
+	fputc('"', fp);
+	for(i = 0; i < max && s[i] != '\0'; ++i)
+		put_char(fp, s[i] < 0x80 ? s[i] : cp437[s[i] - 0x80]);
+	fputc('"', fp);
+}
+
+/*
+ * The samples listed are the ones the loader reads: with a volume and a
+ * length. 'truncated' is set when a module's file ends before their data.
+ */
+static void put_entry(FILE *fp, const scan_entry_t *entry)
+{
+	const uint8_t *smp;
+	uint32_t length, end, sample_bytes = 0, data_end = 0;
+	int i, first = 1;
+
+	fputc('{', fp);
+	put_path(fp, entry->path);
+
+	switch(entry->status)
+	{
+		case SCAN_UNREADABLE:
+			fputs(", \"error\": \"unreadable\"}\n", fp);
+			return;
+		case STM_BAD_TYPE:
+			fputs(", \"error\": \"unknown song type\"}\n", fp);
+			return;
+		case STM_BAD_VERSION:
+			fprintf(fp, ", \"error\": \"unknown version\", \"version\": %d}\n", entry->header.version);
+			return;
+		case STM_OLD_VERSION:
+			fprintf(fp, ", \"error\": \"version before 2.00\", \"version\": %d}\n", entry->header.version);
+			return;
+	}
+
+	fputs(", \"name\": ", fp);
+	put_name(fp, entry->header.song_name, 20);
+	fprintf(fp, ", \"type\": \"%s\", \"version\": %d, \"tempo\": %d, \"patterns\": %d, \"size\": %llu, \"samples\": [",
+		entry->header.type == 1 ? "song" : "module", entry->header.version, entry->header.tempo, entry->header.patterns,
+		(unsigned long long)entry->size);
+
+	for(i = 0; i < 31; ++i)
+	{
+		smp = entry->samples + i * 32;
+		length = smp[16] | (smp[17] << 8);
+		if(!smp[22] || !length)
+			continue;
+
+		fprintf(fp, "%s{\"index\": %d, \"name\": ", first ? "" : ", ", i + 1);
+		put_name(fp, smp, 12);
+		fprintf(fp, ", \"length\": %u, \"volume\": %d, \"c2spd\": %d}", length, smp[22], smp[24] | (smp[25] << 8));
+		first = 0;
+
+		sample_bytes += length;
+		end = ((smp[14] | (smp[15] << 8)) << 4) + length;
+		if(end > data_end)
+			data_end = end;
+	}
+
+	fprintf(fp, "], \"sample_bytes\": %u", sample_bytes);
+	if(entry->header.type == 2)
+		fprintf(fp, ", \"truncated\": %s", data_end > entry->size ? "true" : "false");
+	fputs("}\n", fp);
+}
+
+static void usage(const char *name)
+{
+	printf("usage: %s [options] <dir or file>...\n", name);
+	printf("  -o <file>    write the index here instead of stdout\n");
+	printf("  -j <count>   files read at once (default %d)\n", SCAN_THREADS);
+	exit(-1);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *output = NULL;
+	pthread_t threads[256];
+	size_t i, thread_count = SCAN_THREADS, started;
+	int arg, roots = 0;
+	FILE *fp = stdout;
+
+	for(arg = 1; arg < argc; ++arg)
+	{
+		if(argv[arg][0] != '-' || argv[arg][1] == '\0') {
+			if(walk(argv[arg], 1) < 0) {
+				fprintf(stderr, "%s: out of memory listing %s\n", argv[0], argv[arg]);
+				return 1;
+			}
+			roots++;
+			continue;
+		}
+
+		if(arg + 1 == argc)
+			usage(argv[0]);
+
+		switch(argv[arg][1])
+		{
+			case 'o':
+				output = argv[++arg];
+				break;
+			case 'j':
+				thread_count = strtoul(argv[++arg], NULL, 10);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if(roots == 0 || thread_count == 0 || thread_count > 256)
+		usage(argv[0]);
+
+	if(output != NULL && (fp = fopen(output, "w")) == NULL) {
+		fprintf(stderr, "%s: can't open %s\n", argv[0], output);
+		return 1;
+	}
+
+	if(thread_count > entry_count)
+		thread_count = entry_count;
+	for(started = 0; started < thread_count; ++started)
+		if(pthread_create(&threads[started], NULL, worker, NULL))
+			break;
+
+	worker(NULL);
+	for(i = 0; i < started; ++i)
+		pthread_join(threads[i], NULL);
+
+	qsort(entries, entry_count, sizeof(scan_entry_t), compare_entries);
+	for(i = 0; i < entry_count; ++i)
+	{
+		put_entry(fp, &entries[i]);
+		free(entries[i].path);
+	}
+	free(entries);
+
+	if(fp != stdout)
+		fclose(fp);
+
+	fprintf(stderr, "%zu files indexed\n", entry_count);
+
+	return 0;
+}
@@ -0,0 +1,96 @@
+/*
+ * st2play - very accurate C port of Scream Tracker 2.xx's replayer,
+ *
+ * Copyright 2017 Sergei "x0r" Kolzun
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "st2stats.h"
+
+// Single writer: relaxed atomics are enough to keep readers tear-free.
+#define LOAD(x)      __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE(x, v)  __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define ADD(x, v)    STORE(x, LOAD(x) + (v))
+
+void st2_stats_init(st2_stats_t *stats, uint32_t sample_rate)
+{
+	memset(stats, 0, sizeof(st2_stats_t));
+	stats->sample_rate = sample_rate;
+}
+
+void st2_stats_record(st2_stats_t *stats, size_t frames, uint64_t elapsed_ns, int underrun)
+{
+	uint64_t budget = (uint64_t)frames * 1000000000 / stats->sample_rate;
+	size_t bucket;
+
+	if(budget == 0)
+		bucket = ST2_STATS_BUCKETS - 1;
+	else if(elapsed_ns < budget)
+		bucket = elapsed_ns * 10 / budget;
+	else
+		bucket = elapsed_ns < 2 * budget ? 10 : 11;
+
+	ADD(stats->calls, 1);
+	ADD(stats->histogram[bucket], 1);
+	ADD(stats->total_ns, elapsed_ns);
+	ADD(stats->total_budget_ns, budget);
+	STORE(stats->budget_ns, budget);
+
+	if(elapsed_ns > budget)
+		ADD(stats->late, 1);
+	if(underrun)
+		ADD(stats->underruns, 1);
+	if(elapsed_ns > LOAD(stats->max_ns))
+		STORE(stats->max_ns, elapsed_ns);
+}
+
+void st2_stats_snapshot(const st2_stats_t *stats, st2_stats_t *out)
+{
+	size_t i;
+
+	out->sample_rate = stats->sample_rate;
+	out->calls = LOAD(stats->calls);
+	out->late = LOAD(stats->late);
+	out->underruns = LOAD(stats->underruns);
+	out->budget_ns = LOAD(stats->budget_ns);
+	out->total_ns = LOAD(stats->total_ns);
+	out->total_budget_ns = LOAD(stats->total_budget_ns);
+	out->max_ns = LOAD(stats->max_ns);
+
+	for(i = 0; i < ST2_STATS_BUCKETS; ++i)
+		out->histogram[i] = LOAD(stats->histogram[i]);
+}
+
+void st2_stats_report(const st2_stats_t *stats, const char *name, FILE *fp)
+{
+	st2_stats_t s;
+	size_t i;
+
+	st2_stats_snapshot(stats, &s);
+
+	fprintf(fp, "%s: %llu calls, budget %.3f ms, avg %.3f ms, max %.3f ms, load %.1f%%, %llu late, %llu underruns\n",
+		name, (unsigned long long)s.calls, s.budget_ns / 1e6,
+		s.calls ? (double)s.total_ns / s.calls / 1e6 : 0.0, s.max_ns / 1e6,
+		s.total_budget_ns ? 100.0 * s.total_ns / s.total_budget_ns : 0.0,
+		(unsigned long long)s.late, (unsigned long long)s.underruns);
+
+	fprintf(fp, "%s:", name);
+	for(i = 0; i < 10; ++i)
+		fprintf(fp, " <%d%%:%llu", (int)(i + 1) * 10, (unsigned long long)s.histogram[i]);
+	fprintf(fp, " <200%%:%llu >=200%%:%llu\n", (unsigned long long)s.histogram[10], (unsigned long long)s.histogram[11]);
+}
@@ -0,0 +1,48 @@
+/*
+ * st2play - very accurate C port of Scream Tracker 2.xx's replayer,
+ *
+ * Copyright 2017 Sergei "x0r" Kolzun
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ST2STATS_H
+#define ST2STATS_H
+
+/*
+ * Deadline statistics for a real-time render path. Every call is given
+ * the number of frames it produced and how long it took; the time budget
+ * is what those frames last at the sample rate. One thread records, any
+ * other thread may take a snapshot or print a report.
+ */
+
+#define ST2_STATS_BUCKETS 12	/* 10% steps of the budget, then <200% and >=200% */
+
+typedef struct st2_stats_s {
+	uint32_t sample_rate;
+	uint64_t calls;
+	uint64_t late;			/* took longer than the budget */
+	uint64_t underruns;		/* could not deliver all requested frames */
+	uint64_t budget_ns;		/* budget of the most recent call */
+	uint64_t total_ns;
+	uint64_t total_budget_ns;
+	uint64_t max_ns;
+	uint64_t histogram[ST2_STATS_BUCKETS];
+} st2_stats_t;
+
+void st2_stats_init(st2_stats_t *stats, uint32_t sample_rate);
+void st2_stats_record(st2_stats_t *stats, size_t frames, uint64_t elapsed_ns, int underrun);
+void st2_stats_snapshot(const st2_stats_t *stats, st2_stats_t *out);
+void st2_stats_report(const st2_stats_t *stats, const char *name, FILE *fp);
+
+#endif
@@ -20,111 +20,211 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#if defined(__unix__) || defined(__APPLE__)
+#define STM_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #include "st2play.h"
 #include "stmload.h"
 
-static uint16_t fgetw(FILE *fp);
-static uint32_t fgetl(FILE *fp);
+typedef struct stm_reader_s {
+	const uint8_t *data;
+	size_t size;
+	size_t pos;
+} stm_reader_t;
 
-static uint16_t fgetw(FILE *fp)
+typedef struct stm_lazy_s {
+	int fd;
+	uint8_t advised[32];	/* prefetch asked for the sample */
+} stm_lazy_t;
+
+// Songs (type 1) keep their samples in separate files.
+typedef struct stm_external_s {
+	st2_song_t *song;
+	char **dirs;
+	size_t dir_count;
+	int next;		/* next sample to fetch, taken atomically */
+} stm_external_t;
+
+#define STM_IO_THREADS 8
+
+// Header, sample headers and orders; patterns follow, at most 1024 bytes each.
+#define STM_PREFIX_SIZE (48 + 31 * 32 + 128)
+
+#define STM_CACHE_ALIGN 16
+
+static int mgetc(stm_reader_t *rd);
+static uint16_t mgetw(stm_reader_t *rd);
+static uint32_t mgetl(stm_reader_t *rd);
+static void mread(void *dst, size_t len, stm_reader_t *rd);
+static void module_release(uint8_t *data, size_t size);
+static void module_unmap(uint8_t *data, size_t size);
+static int stm_parse(st2_song_t *song, const uint8_t *data, size_t size, int load_samples);
+static uint8_t *lazy_fetch(st2_song_t *song, size_t smp);
+static void lazy_prefetch(st2_song_t *song, size_t smp);
+static void lazy_close(void *loader);
+static uint64_t hash_bytes(const uint8_t *data, size_t size);
+#ifdef STM_MMAP
+static st2_song_t *cache_map(const char *path, const char *filename, const struct stat *src);
+static void cache_write(const st2_song_t *song, const char *path, const struct stat *src);
+#endif
+static int attach_song(st2_context_t *ctx, st2_song_t *song);
+static int external_open(stm_external_t *ext, size_t smp, FILE **fp);
+static void *external_worker(void *arg);
+static void load_external(st2_song_t *song, const char *filename, const char *sample_path);
+static st2_song_t *load_file(const char *filename, const char *sample_path);
+
+// Same EOF behaviour as the stdio functions the loader used to call.
+static int mgetc(stm_reader_t *rd)
+{
+	return rd->pos < rd->size ? rd->data[rd->pos++] : EOF;
+}
+
+static uint16_t mgetw(stm_reader_t *rd)
 {
 	uint8_t data[2];
 
-	data[0] = fgetc(fp);
-	data[1] = fgetc(fp);
+	data[0] = mgetc(rd);
+	data[1] = mgetc(rd);
 
 	return (data[1] << 8) | data[0];
 }
 
-static uint32_t fgetl(FILE *fp)
+static uint32_t mgetl(stm_reader_t *rd)
 {
 	uint8_t data[4];
 
-	data[0] = fgetc(fp);
-	data[1] = fgetc(fp);
-	data[2] = fgetc(fp);
-	data[3] = fgetc(fp);
+	data[0] = mgetc(rd);
+	data[1] = mgetc(rd);
+	data[2] = mgetc(rd);
+	data[3] = mgetc(rd);
 
 	return (data[3] << 24) | (data[2] << 16) | (data[1] << 8) | data[0];
 }
 
-int stm_load(st2_context_t *ctx, const char *filename)
+static void mread(void *dst, size_t len, stm_reader_t *rd)
 {
-	FILE *fp;
-	stm_header_t stm;
+	if(len > rd->size - rd->pos)
+		len = rd->size - rd->pos;
 
-	uint8_t code;
-	int i, j, result = -1;
+	memcpy(dst, rd->data + rd->pos, len);
+	rd->pos += len;
+}
 
-	if((fp = fopen(filename, "rb")) == NULL)
-	{
-		printf("LOAD ERROR!\n");
-		goto cleanup;
-	}
+static void module_release(uint8_t *data, size_t size)
+{
+	free(data);
+}
 
-	fread(&stm.song_name, 1, 20, fp);
-	fread(&stm.tracker_name, 1, 9, fp);
+static void module_unmap(uint8_t *data, size_t size)
+{
+#ifdef STM_MMAP
+	munmap(data, size);
+#endif
+}
 
-	stm.type = fgetc(fp);
-	if(stm.type != 1 && stm.type != 2)
-	{
-		printf("Unknown song type!\n");
-		goto cleanup;
-	}
+int stm_read_header(const uint8_t *data, size_t size, stm_header_t *stm)
+{
+	stm_reader_t rd;
 
-	stm.version = 100 * fgetc(fp) + fgetc(fp);
-	if(stm.version > 221)
-	{
-		printf("Unknown version!\n");
-		goto cleanup;
-	}
+	rd.data = data;
+	rd.size = size;
+	rd.pos = 0;
+
+	memset(stm, 0, sizeof(stm_header_t));
+	mread(&stm->song_name, 20, &rd);
+	mread(&stm->tracker_name, 9, &rd);
+
+	stm->type = mgetc(&rd);
+	if(stm->type != 1 && stm->type != 2)
+		return STM_BAD_TYPE;
+
+	stm->version = 100 * mgetc(&rd);
+	stm->version += mgetc(&rd);
+	if(stm->version > 221)
+		return STM_BAD_VERSION;
+
+	if(stm->version != 200 && stm->version != 210 && stm->version != 220 && stm->version != 221)
+		return STM_OLD_VERSION;
+
+	stm->tempo = mgetc(&rd);
+	if(stm->version < 221)
+		stm->tempo = (stm->tempo / 10 << 4) + stm->tempo % 10;
+
+	stm->patterns = mgetc(&rd);
+	stm->gvol = mgetc(&rd);
+	mread(&stm->reserved, 13, &rd);
 
-	if(stm.version != 200 && stm.version != 210 && stm.version != 220 && stm.version != 221)
+	return 0;
+}
+
+static int stm_parse(st2_song_t *song, const uint8_t *data, size_t size, int load_samples)
+{
+	stm_reader_t rd;
+	stm_header_t stm;
+
+	uint8_t code;
+	int i, j;
+	size_t offset;
+
+	switch(stm_read_header(data, size, &stm))
 	{
-		printf("TODO: File version (%i) prior to 2.\n", stm.version);
-		goto cleanup;
+		case STM_BAD_TYPE:
+			printf("Unknown song type!\n");
+			return -1;
+		case STM_BAD_VERSION:
+			printf("Unknown version!\n");
+			return -1;
+		case STM_OLD_VERSION:
+			printf("TODO: File version (%i) prior to 2.\n", stm.version);
+			return -1;
 	}
 
-	stm.tempo = fgetc(fp);
-	if(stm.version < 221)
-		stm.tempo = (stm.tempo / 10 << 4) + stm.tempo % 10;
-	ctx->tempo = stm.tempo;
+	// Sample headers start right after it, a shorter file reads as EOF from here on.
+	rd.data = data;
+	rd.size = size;
+	rd.pos = size < 48 ? size : 48;
 
-	stm.patterns = fgetc(fp);
+	song->tempo = stm.tempo;
+	song->patterns = stm.patterns;
 
-	// TODO: song_init
-	ctx->order_list_ptr = (uint8_t *)(malloc(128));
-	ctx->pattern_data_ptr = (uint8_t *)(malloc(65536));
-	// TODO: song_init
+	// Position jumps can reach any order, the ones not in the file end the song.
+	song->order_list_ptr = (uint8_t *)(malloc(256));
+	song->pattern_data_ptr = (uint8_t *)(malloc(stm.patterns * 1024 + 1));
+	if(song->order_list_ptr == NULL || song->pattern_data_ptr == NULL)
+		return -1;
+	memset(song->order_list_ptr, 99, 256);
 
-	stm.gvol = fgetc(fp);
 	if(stm.version > 210)
-		ctx->global_volume = stm.gvol;
-	
-	fread(&stm.reserved, 1, 13, fp);
+		song->global_volume = stm.gvol;
 
 	for(i = 1; i < 32; ++i) {
-		fread(&ctx->samples[i].name, 1, 12, fp);
-		ctx->samples[i].id = fgetc(fp);
-		ctx->samples[i].disk = fgetc(fp);
-		ctx->samples[i].offset = fgetw(fp);
-		ctx->samples[i].length = fgetw(fp);
-		ctx->samples[i].loop_start = fgetw(fp);
-		ctx->samples[i].loop_end = fgetw(fp);
-
-		if(ctx->samples[i].loop_end == 0)
-			ctx->samples[i].loop_end = 0xffff;
-
-		ctx->samples[i].volume = fgetc(fp);
-		ctx->samples[i].rsvd2 = fgetc(fp);
-		ctx->samples[i].c2spd = fgetw(fp);
-		ctx->samples[i].rsvd3 = fgetl(fp);
-		ctx->samples[i].length_par = fgetw(fp);
+		mread(&song->samples[i].name, 12, &rd);
+		song->samples[i].id = mgetc(&rd);
+		song->samples[i].disk = mgetc(&rd);
+		song->samples[i].offset = mgetw(&rd);
+		song->samples[i].length = mgetw(&rd);
+		song->samples[i].loop_start = mgetw(&rd);
+		song->samples[i].loop_end = mgetw(&rd);
+
+		if(song->samples[i].loop_end == 0)
+			song->samples[i].loop_end = 0xffff;
+
+		song->samples[i].volume = mgetc(&rd);
+		song->samples[i].rsvd2 = mgetc(&rd);
+		song->samples[i].c2spd = mgetw(&rd);
+		song->samples[i].rsvd3 = mgetl(&rd);
+		song->samples[i].length_par = mgetw(&rd);
 
 		// NON-ST2: amegas.stm has some samples with loop-point over the sample length.
-		if(ctx->samples[i].loop_end != 0xffff && ctx->samples[i].loop_end > ctx->samples[i].length)
-			ctx->samples[i].loop_end = ctx->samples[i].length;
+		if(song->samples[i].loop_end != 0xffff && song->samples[i].loop_end > song->samples[i].length)
+			song->samples[i].loop_end = song->samples[i].length;
 	}
 
 	if(stm.version == 200)
@@ -132,63 +232,698 @@ int stm_load(st2_context_t *ctx, const char *filename)
 	else
 		i = 128;
 
-	fread(ctx->order_list_ptr, 1, i, fp);
+	mread(song->order_list_ptr, i, &rd);
 
 	for(i = 0; i < stm.patterns; ++i)
 	{
 		for(j = 0; j < 1024; ++j)
 		{
-			code = fgetc(fp);
+			code = mgetc(&rd);
 			switch(code)
 			{
 				case 0xfb:
-					ctx->pattern_data_ptr[(i << 10) + j] = 0; ++j;
-					ctx->pattern_data_ptr[(i << 10) + j] = 0; ++j;
-					ctx->pattern_data_ptr[(i << 10) + j] = 0; ++j;
-					ctx->pattern_data_ptr[(i << 10) + j] = 0;
+					song->pattern_data_ptr[(i << 10) + j] = 0; ++j;
+					song->pattern_data_ptr[(i << 10) + j] = 0; ++j;
+					song->pattern_data_ptr[(i << 10) + j] = 0; ++j;
+					song->pattern_data_ptr[(i << 10) + j] = 0;
 					break;
 				case 0xfd:
-					ctx->pattern_data_ptr[(i << 10) + j] = 0xfe; ++j;
-					ctx->pattern_data_ptr[(i << 10) + j] = 0x01; ++j;
-					ctx->pattern_data_ptr[(i << 10) + j] = 0x80; ++j;
-					ctx->pattern_data_ptr[(i << 10) + j] = 0;
+					song->pattern_data_ptr[(i << 10) + j] = 0xfe; ++j;
+					song->pattern_data_ptr[(i << 10) + j] = 0x01; ++j;
+					song->pattern_data_ptr[(i << 10) + j] = 0x80; ++j;
+					song->pattern_data_ptr[(i << 10) + j] = 0;
 					break;
 				case 0xfc:
-					ctx->pattern_data_ptr[(i << 10) + j] = 0xff; ++j;
-					ctx->pattern_data_ptr[(i << 10) + j] = 0x01; ++j;
-					ctx->pattern_data_ptr[(i << 10) + j] = 0x80; ++j;
-					ctx->pattern_data_ptr[(i << 10) + j] = 0;
+					song->pattern_data_ptr[(i << 10) + j] = 0xff; ++j;
+					song->pattern_data_ptr[(i << 10) + j] = 0x01; ++j;
+					song->pattern_data_ptr[(i << 10) + j] = 0x80; ++j;
+					song->pattern_data_ptr[(i << 10) + j] = 0;
 					break;
 				default:
-					ctx->pattern_data_ptr[(i << 10) + j] = code; ++j;
-					ctx->pattern_data_ptr[(i << 10) + j] = fgetc(fp); ++j;
-					code = ctx->pattern_data_ptr[(i << 10) + j] = fgetc(fp); ++j;
-					ctx->pattern_data_ptr[(i << 10) + j] = fgetc(fp);
+					song->pattern_data_ptr[(i << 10) + j] = code; ++j;
+					song->pattern_data_ptr[(i << 10) + j] = mgetc(&rd); ++j;
+					code = song->pattern_data_ptr[(i << 10) + j] = mgetc(&rd); ++j;
+					song->pattern_data_ptr[(i << 10) + j] = mgetc(&rd);
 					if(stm.version < 221 && (code & 0x0f) == 1) {
-						code = ctx->pattern_data_ptr[(i << 10) + j];
-						ctx->pattern_data_ptr[(i << 10) + j] = (code / 10 << 4) + code % 10;
+						code = song->pattern_data_ptr[(i << 10) + j];
+						song->pattern_data_ptr[(i << 10) + j] = (code / 10 << 4) + code % 10;
 					}
 			}
 		}
 	}
 
-	// TODO: Add external samples support.
-	if(stm.type == 2) {
+	if(st2_song_prepare(song))
+		return -1;
+
+	// Samples of songs (type 1) are separate files, see load_external.
+	if(stm.type == 2 && load_samples) {
 		for(i = 1; i < 32; ++i)
 		{
-			if(ctx->samples[i].volume && ctx->samples[i].length)
+			if(song->samples[i].volume && song->samples[i].length)
 			{
-				fseek(fp, ctx->samples[i].offset << 4, SEEK_SET);
-				ctx->samples[i].data = (uint8_t *)(calloc(ctx->samples[i].length + 1, 1));
-				fread(ctx->samples[i].data, 1, ctx->samples[i].length, fp);
+				offset = song->samples[i].offset << 4;
+				if(offset + song->samples[i].length <= size) {
+					// Zero-copy: the mixer never reads past 'length', so the module itself will do.
+					song->samples[i].data = (uint8_t *)(data + offset);
+				} else {
+					// Truncated file, pad the missing tail with silence.
+					song->samples[i].data = (uint8_t *)(calloc(song->samples[i].length + 1, 1));
+					if(offset < size)
+						memcpy(song->samples[i].data, data + offset, size - offset);
+				}
 			}
 		}
 	}
 
-	result = 0;
-cleanup:
-	if(fp)
+	return 0;
+}
+
+st2_song_t *stm_load_song_mem(const uint8_t *data, size_t size)
+{
+	st2_song_t *song;
+
+	if((song = st2_song_create()) == NULL)
+		return NULL;
+
+	song->module_data = (uint8_t *)data;
+	song->module_size = size;
+
+	if(stm_parse(song, data, size, 1)) {
+		st2_song_release(song);
+		return NULL;
+	}
+
+	return song;
+}
+
+st2_song_t *stm_load_song_mmap(const char *filename)
+{
+#ifdef STM_MMAP
+	int fd;
+	struct stat st;
+	void *data;
+	st2_song_t *song;
+
+	if((fd = open(filename, O_RDONLY)) < 0)
+	{
+		printf("LOAD ERROR!\n");
+		return NULL;
+	}
+
+	if(fstat(fd, &st) < 0 || st.st_size == 0 || (data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+	{
+		printf("LOAD ERROR!\n");
+		close(fd);
+		return NULL;
+	}
+
+	close(fd);
+
+	if((song = st2_song_create()) == NULL) {
+		munmap(data, st.st_size);
+		return NULL;
+	}
+
+	song->module_data = (uint8_t *)data;
+	song->module_size = st.st_size;
+	song->module_free = module_unmap;
+
+	if(stm_parse(song, data, st.st_size, 1)) {
+		st2_song_release(song);
+		return NULL;
+	}
+
+	if(((uint8_t *)data)[29] == 1)
+		load_external(song, filename, NULL);
+
+	return song;
+#else
+	return stm_load_song(filename);
+#endif
+}
+
+static st2_song_t *load_file(const char *filename, const char *sample_path)
+{
+	FILE *fp;
+	uint8_t *data;
+	long size;
+	st2_song_t *song;
+
+	if((fp = fopen(filename, "rb")) == NULL)
+	{
+		printf("LOAD ERROR!\n");
+		return NULL;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	if(size <= 0 || (data = (uint8_t *)(malloc(size))) == NULL)
+	{
+		printf("LOAD ERROR!\n");
 		fclose(fp);
+		return NULL;
+	}
+
+	size = fread(data, 1, size, fp);
+	fclose(fp);
+
+	if((song = st2_song_create()) == NULL) {
+		free(data);
+		return NULL;
+	}
+
+	song->module_data = data;
+	song->module_size = size;
+	song->module_free = module_release;
+
+	if(stm_parse(song, data, size, 1)) {
+		st2_song_release(song);
+		return NULL;
+	}
+
+	if(data[29] == 1)
+		load_external(song, filename, sample_path);
+
+	return song;
+}
+
+st2_song_t *stm_load_song(const char *filename)
+{
+	return load_file(filename, NULL);
+}
+
+st2_song_t *stm_load_song_paths(const char *filename, const char *sample_path)
+{
+	return load_file(filename, sample_path);
+}
+
+#ifdef STM_MMAP
+// The same samples stm_parse would have loaded, read on first use.
+static uint8_t *lazy_fetch(st2_song_t *song, size_t smp)
+{
+	stm_lazy_t *lazy = (stm_lazy_t *)song->loader;
+	st2_sample_t *sample = &song->samples[smp];
+	uint8_t *data, *expected = NULL;
+	ssize_t len;
+
+	if(!sample->volume || !sample->length)
+		return NULL;
+
+	// A truncated file leaves the missing tail silent, as in stm_parse.
+	data = (uint8_t *)(calloc(sample->length + 1, 1));
+	if(data == NULL)
+		return NULL;
+
+	len = pread(lazy->fd, data, sample->length, (off_t)sample->offset << 4);
+	if(len < 0)
+		memset(data, 0, sample->length);
+
+	// Another thread sharing the song may have fetched it first.
+	if(!__atomic_compare_exchange_n(&sample->data, &expected, data, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free(data);
+		return expected;
+	}
+
+	return data;
+}
+
+// Only a hint: the kernel reads the sample in the background, and lazy_fetch finds it in the page cache.
+static void lazy_prefetch(st2_song_t *song, size_t smp)
+{
+	stm_lazy_t *lazy = (stm_lazy_t *)song->loader;
+	st2_sample_t *sample = &song->samples[smp];
+
+	if(!sample->volume || !sample->length || __atomic_exchange_n(&lazy->advised[smp], 1, __ATOMIC_RELAXED))
+		return;
+
+#ifdef POSIX_FADV_WILLNEED
+	posix_fadvise(lazy->fd, (off_t)sample->offset << 4, sample->length, POSIX_FADV_WILLNEED);
+#endif
+}
 
-	return result;
+static void lazy_close(void *loader)
+{
+	stm_lazy_t *lazy = (stm_lazy_t *)loader;
+
+	close(lazy->fd);
+	free(lazy);
+}
+#endif
+
+st2_song_t *stm_load_song_lazy(const char *filename)
+{
+#ifdef STM_MMAP
+	int fd;
+	uint8_t *data, *more;
+	size_t size;
+	ssize_t len;
+	stm_lazy_t *lazy;
+	st2_song_t *song;
+
+	if((fd = open(filename, O_RDONLY)) < 0)
+	{
+		printf("LOAD ERROR!\n");
+		return NULL;
+	}
+
+	// Everything up to the end of the pattern data, perhaps the start of the samples too.
+	if((data = (uint8_t *)(malloc(STM_PREFIX_SIZE))) == NULL || (len = pread(fd, data, STM_PREFIX_SIZE, 0)) <= 0)
+	{
+		printf("LOAD ERROR!\n");
+		free(data);
+		close(fd);
+		return NULL;
+	}
+
+	size = len;
+	if(size == STM_PREFIX_SIZE && data[33] != 0) {
+		if((more = (uint8_t *)(realloc(data, STM_PREFIX_SIZE + data[33] * 1024))) == NULL) {
+			free(data);
+			close(fd);
+			return NULL;
+		}
+		data = more;
+		if((len = pread(fd, data + STM_PREFIX_SIZE, data[33] * 1024, STM_PREFIX_SIZE)) > 0)
+			size += len;
+	}
+
+	lazy = (stm_lazy_t *)(calloc(1, sizeof(stm_lazy_t)));
+	if(lazy == NULL || (song = st2_song_create()) == NULL) {
+		free(lazy);
+		free(data);
+		close(fd);
+		return NULL;
+	}
+
+	lazy->fd = fd;
+	song->module_data = data;
+	song->module_size = size;
+	song->module_free = module_release;
+	song->loader = lazy;
+	song->loader_free = lazy_close;
+
+	if(stm_parse(song, data, size, 0)) {
+		st2_song_release(song);
+		return NULL;
+	}
+
+	// Songs (type 1) have no sample data in the file, their sample files are small.
+	if(data[29] == 2) {
+		song->sample_fetch = lazy_fetch;
+		song->sample_prefetch = lazy_prefetch;
+	} else
+		load_external(song, filename, NULL);
+
+	return song;
+#else
+	return stm_load_song(filename);
+#endif
+}
+
+static uint64_t hash_bytes(const uint8_t *data, size_t size)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for(i = 0; i < size; ++i)
+		hash = (hash ^ data[i]) * 0x100000001b3ULL;
+
+	return hash;
+}
+
+#ifdef STM_MMAP
+// Returns NULL if the cache is missing, stale or damaged.
+static st2_song_t *cache_map(const char *path, const char *filename, const struct stat *src)
+{
+	int fd;
+	struct stat st;
+	uint8_t *data, *module;
+	const stm_cache_header_t *hdr;
+	const stm_cache_sample_t *cs;
+	st2_song_t *song;
+	size_t i, end;
+	FILE *fp;
+	int valid;
+
+	if((fd = open(path, O_RDONLY)) < 0)
+		return NULL;
+
+	if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(stm_cache_header_t) || (data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+
+	close(fd);
+
+	hdr = (const stm_cache_header_t *)data;
+	valid = hdr->magic == STM_CACHE_MAGIC && hdr->version == STM_CACHE_VERSION && hdr->size == (uint64_t)st.st_size &&
+		hdr->source_size == (uint64_t)src->st_size &&
+		hdr->order_offset >= sizeof(stm_cache_header_t) && (uint64_t)hdr->order_offset + 256 <= hdr->size &&
+		hdr->pattern_offset >= sizeof(stm_cache_header_t) && (uint64_t)hdr->pattern_offset + hdr->patterns * 1024 + 1 <= hdr->size &&
+		hdr->track_offset >= sizeof(stm_cache_header_t) && hdr->track_offset % STM_CACHE_ALIGN == 0 &&
+		(uint64_t)hdr->track_offset + hdr->patterns * 4 * sizeof(st2_track_t) <= hdr->size;
+
+	for(i = 1; valid && i < 32; ++i)
+	{
+		cs = &hdr->samples[i];
+		end = (size_t)cs->data_offset + cs->length + 1;
+		if(cs->data_offset && (cs->data_offset < sizeof(stm_cache_header_t) || end > hdr->size))
+			valid = 0;
+	}
+
+	// A touched but unchanged module still matches by content.
+	if(valid && hdr->source_mtime != (int64_t)src->st_mtime) {
+		valid = 0;
+		if((fp = fopen(filename, "rb")) != NULL) {
+			if((module = (uint8_t *)(malloc(hdr->source_size ? hdr->source_size : 1))) != NULL) {
+				if(fread(module, 1, hdr->source_size, fp) == hdr->source_size)
+					valid = hash_bytes(module, hdr->source_size) == hdr->source_hash;
+				free(module);
+			}
+			fclose(fp);
+		}
+	}
+
+	if(!valid || (song = st2_song_create()) == NULL) {
+		munmap(data, st.st_size);
+		return NULL;
+	}
+
+	song->module_data = data;
+	song->module_size = st.st_size;
+	song->module_free = module_unmap;
+	song->tempo = hdr->tempo;
+	song->global_volume = hdr->global_volume;
+	song->patterns = hdr->patterns;
+	song->order_list_ptr = data + hdr->order_offset;
+	song->pattern_data_ptr = data + hdr->pattern_offset;
+	song->tracks = hdr->patterns ? (st2_track_t *)(data + hdr->track_offset) : NULL;
+
+	for(i = 1; i < 32; ++i)
+	{
+		cs = &hdr->samples[i];
+		memcpy(song->samples[i].name, cs->name, 12);
+		song->samples[i].id = cs->id;
+		song->samples[i].disk = cs->disk;
+		song->samples[i].offset = cs->offset;
+		song->samples[i].length = cs->length;
+		song->samples[i].loop_start = cs->loop_start;
+		song->samples[i].loop_end = cs->loop_end;
+		song->samples[i].volume = cs->volume;
+		song->samples[i].rsvd2 = cs->rsvd2;
+		song->samples[i].c2spd = cs->c2spd;
+		song->samples[i].rsvd3 = cs->rsvd3;
+		song->samples[i].length_par = cs->length_par;
+		song->samples[i].data = cs->data_offset ? data + cs->data_offset : NULL;
+	}
+
+	if(st2_song_prepare(song)) {
+		st2_song_release(song);
+		return NULL;
+	}
+
+	return song;
+}
+
+// Best effort, a cache that can't be written only costs the next load a parse.
+static void cache_write(const st2_song_t *song, const char *path, const struct stat *src)
+{
+	stm_cache_header_t *hdr;
+	stm_cache_sample_t *cs;
+	uint8_t *data;
+	size_t i, size, pattern_size, track_size;
+	char *tmp;
+	FILE *fp;
+	int ok;
+
+	pattern_size = song->patterns * 1024 + 1;
+	track_size = song->patterns * 4 * sizeof(st2_track_t);
+	size = ((sizeof(stm_cache_header_t) + 256 + pattern_size + STM_CACHE_ALIGN - 1) & ~(size_t)(STM_CACHE_ALIGN - 1)) + track_size;
+	for(i = 1; i < 32; ++i)
+		if(song->samples[i].data)
+			size = ((size + STM_CACHE_ALIGN - 1) & ~(size_t)(STM_CACHE_ALIGN - 1)) + song->samples[i].length + 1;
+
+	if((data = (uint8_t *)(calloc(size, 1))) == NULL)
+		return;
+
+	hdr = (stm_cache_header_t *)data;
+	hdr->magic = STM_CACHE_MAGIC;
+	hdr->version = STM_CACHE_VERSION;
+	hdr->source_size = song->module_size;
+	hdr->source_mtime = src->st_mtime;
+	hdr->source_hash = hash_bytes(song->module_data, song->module_size);
+	hdr->tempo = song->tempo;
+	hdr->global_volume = song->global_volume;
+	hdr->patterns = song->patterns;
+	hdr->order_offset = sizeof(stm_cache_header_t);
+	hdr->pattern_offset = hdr->order_offset + 256;
+	hdr->track_offset = (hdr->pattern_offset + pattern_size + STM_CACHE_ALIGN - 1) & ~(size_t)(STM_CACHE_ALIGN - 1);
+	hdr->size = size;
+
+	memcpy(data + hdr->order_offset, song->order_list_ptr, 256);
+	memcpy(data + hdr->pattern_offset, song->pattern_data_ptr, pattern_size);
+	memcpy(data + hdr->track_offset, song->tracks, track_size);
+
+	size = hdr->track_offset + track_size;
+	for(i = 1; i < 32; ++i)
+	{
+		cs = &hdr->samples[i];
+		memcpy(cs->name, song->samples[i].name, 12);
+		cs->id = song->samples[i].id;
+		cs->disk = song->samples[i].disk;
+		cs->offset = song->samples[i].offset;
+		cs->length = song->samples[i].length;
+		cs->loop_start = song->samples[i].loop_start;
+		cs->loop_end = song->samples[i].loop_end;
+		cs->volume = song->samples[i].volume;
+		cs->rsvd2 = song->samples[i].rsvd2;
+		cs->c2spd = song->samples[i].c2spd;
+		cs->rsvd3 = song->samples[i].rsvd3;
+		cs->length_par = song->samples[i].length_par;
+
+		if(song->samples[i].data) {
+			size = (size + STM_CACHE_ALIGN - 1) & ~(size_t)(STM_CACHE_ALIGN - 1);
+			cs->data_offset = size;
+			memcpy(data + size, song->samples[i].data, song->samples[i].length);
+			size += song->samples[i].length + 1;
+		}
+	}
+
+	// Written aside and renamed into place, so readers never map a partial file.
+	if((tmp = (char *)(malloc(strlen(path) + 32))) != NULL) {
+		sprintf(tmp, "%s.%ld.tmp", path, (long)getpid());
+		ok = 0;
+		if((fp = fopen(tmp, "wb")) != NULL) {
+			ok = fwrite(data, 1, size, fp) == size;
+			ok = fclose(fp) == 0 && ok;
+		}
+		if(!ok || rename(tmp, path) < 0)
+			unlink(tmp);
+		free(tmp);
+	}
+
+	free(data);
+}
+#endif
+
+st2_song_t *stm_load_song_cached(const char *filename, const char *cache_dir)
+{
+#ifdef STM_MMAP
+	struct stat src;
+	char *path;
+	st2_song_t *song;
+
+	if(stat(filename, &src) < 0)
+	{
+		printf("LOAD ERROR!\n");
+		return NULL;
+	}
+
+	// Keyed by file identity, the header tells whether the contents still match.
+	if((path = (char *)(malloc(strlen(cache_dir) + 48))) == NULL)
+		return NULL;
+	sprintf(path, "%s/%llx-%llx.st2c", cache_dir, (unsigned long long)src.st_dev, (unsigned long long)src.st_ino);
+
+	if((song = cache_map(path, filename, &src)) == NULL) {
+		song = stm_load_song(filename);
+		// The sample files of songs (type 1) could change behind the cache's back.
+		if(song != NULL && (uint64_t)song->module_size == (uint64_t)src.st_size && song->module_data[29] == 2)
+			cache_write(song, path, &src);
+	}
+
+	free(path);
+	return song;
+#else
+	return stm_load_song(filename);
+#endif
+}
+
+#ifdef STM_MMAP
+// Tries the sample's name as stored, then in lower and upper case.
+static int external_open(stm_external_t *ext, size_t smp, FILE **fp)
+{
+	char name[13], path[4096];
+	size_t i, j, len;
+	int variant;
+
+	memcpy(name, ext->song->samples[smp].name, 12);
+	name[12] = '\0';
+	for(len = strlen(name); len > 0 && name[len - 1] == ' '; --len);
+	name[len] = '\0';
+
+	if(len == 0 || strchr(name, '/') != NULL)
+		return -1;
+
+	for(i = 0; i < ext->dir_count; ++i)
+	{
+		for(variant = 0; variant < 3; ++variant)
+		{
+			for(j = 0; j < len && variant; ++j)
+				name[j] = variant == 1 ? tolower((uint8_t)name[j]) : toupper((uint8_t)name[j]);
+			snprintf(path, sizeof(path), "%s/%s", ext->dirs[i], name);
+			if((*fp = fopen(path, "rb")) != NULL)
+				return 0;
+		}
+		memcpy(name, ext->song->samples[smp].name, len);
+	}
+
+	return -1;
+}
+
+static void *external_worker(void *arg)
+{
+	stm_external_t *ext = (stm_external_t *)arg;
+	st2_sample_t *sample;
+	FILE *fp;
+	int i;
+
+	while((i = __atomic_fetch_add(&ext->next, 1, __ATOMIC_RELAXED)) < 32) {
+		sample = &ext->song->samples[i];
+		if(i == 0 || !sample->volume || !sample->length || external_open(ext, i, &fp))
+			continue;
+
+		// Raw signed 8-bit data, a short file leaves the tail silent.
+		sample->data = (uint8_t *)(calloc(sample->length + 1, 1));
+		if(sample->data != NULL && fread(sample->data, 1, sample->length, fp) == 0) {
+			free(sample->data);
+			sample->data = NULL;
+		}
+		fclose(fp);
+	}
+
+	return NULL;
+}
+#endif
+
+/*
+ * Looks for each sample file next to the module, then in the ':'-separated
+ * directories of 'sample_path'. Every open and read is a round trip on a
+ * network disk, so a few threads fetch the samples in parallel.
+ */
+static void load_external(st2_song_t *song, const char *filename, const char *sample_path)
+{
+#ifdef STM_MMAP
+	stm_external_t ext;
+	pthread_t threads[STM_IO_THREADS];
+	char *paths, *dir, *slash, *colon;
+	size_t i, count, started;
+
+	for(i = 1, count = 0; i < 32; ++i)
+		if(song->samples[i].volume && song->samples[i].length)
+			count++;
+	if(count == 0)
+		return;
+
+	paths = (char *)(malloc(strlen(filename) + 3 + (sample_path ? strlen(sample_path) : 0)));
+	ext.dirs = (char **)(malloc(sizeof(char *) * (2 + (sample_path ? strlen(sample_path) : 0))));
+	if(paths == NULL || ext.dirs == NULL) {
+		free(paths);
+		free(ext.dirs);
+		return;
+	}
+
+	strcpy(paths, filename);
+	if((slash = strrchr(paths, '/')) != NULL)
+		*slash = '\0';
+	else
+		strcpy(paths, ".");
+	ext.dirs[0] = paths;
+	ext.dir_count = 1;
+
+	if(sample_path != NULL) {
+		dir = paths + strlen(paths) + 1;
+		strcpy(dir, sample_path);
+		while(dir != NULL) {
+			if((colon = strchr(dir, ':')) != NULL)
+				*colon++ = '\0';
+			if(*dir != '\0')
+				ext.dirs[ext.dir_count++] = dir;
+			dir = colon;
+		}
+	}
+
+	ext.song = song;
+	ext.next = 0;
+
+	if(count > STM_IO_THREADS)
+		count = STM_IO_THREADS;
+	for(started = 0; started < count; ++started)
+		if(pthread_create(&threads[started], NULL, external_worker, &ext))
+			break;
+
+	// Whatever the threads don't get to, this one does.
+	external_worker(&ext);
+	for(i = 0; i < started; ++i)
+		pthread_join(threads[i], NULL);
+
+	for(i = 1; i < 32; ++i)
+		if(song->samples[i].volume && song->samples[i].length && song->samples[i].data == NULL)
+			printf("Sample %.12s not found!\n", song->samples[i].name);
+
+	free(ext.dirs);
+	free(paths);
+#endif
+}
+
+static int attach_song(st2_context_t *ctx, st2_song_t *song)
+{
+	if(song == NULL)
+		return -1;
+
+	st2_tracker_set_song(ctx, song);
+	st2_song_release(song);
+
+	return 0;
+}
+
+int stm_load_mem(st2_context_t *ctx, const uint8_t *data, size_t size)
+{
+	return attach_song(ctx, stm_load_song_mem(data, size));
+}
+
+int stm_load_mmap(st2_context_t *ctx, const char *filename)
+{
+	return attach_song(ctx, stm_load_song_mmap(filename));
+}
+
+int stm_load_lazy(st2_context_t *ctx, const char *filename)
+{
+	return attach_song(ctx, stm_load_song_lazy(filename));
+}
+
+int stm_load_cached(st2_context_t *ctx, const char *filename, const char *cache_dir)
+{
+	return attach_song(ctx, stm_load_song_cached(filename, cache_dir));
+}
+
+int stm_load_paths(st2_context_t *ctx, const char *filename, const char *sample_path)
+{
+	return attach_song(ctx, stm_load_song_paths(filename, sample_path));
+}
+
+int stm_load(st2_context_t *ctx, const char *filename)
+{
+	return attach_song(ctx, stm_load_song(filename));
 }
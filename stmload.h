@@ -30,6 +30,76 @@ typedef struct stm_header_s {
 	uint8_t reserved[13];	/* Reserved */
 } stm_header_t;
 
+#define STM_BAD_TYPE     -1
+#define STM_BAD_VERSION  -2
+#define STM_OLD_VERSION  -3	/* before 2.00, not supported yet */
+
+// Decoded songs cached on disk by stm_load_song_cached(), in native byte order
+// so the file can be mapped and used as is. Offsets are from the start of the
+// file, each sample is followed by one byte of silence.
+#define STM_CACHE_MAGIC   0x43325453	/* 'ST2C', reads differently on the other byte order */
+#define STM_CACHE_VERSION 2
+
+typedef struct stm_cache_sample_s {
+	uint8_t name[12];
+	uint8_t id;
+	uint8_t disk;
+	uint16_t offset;
+	uint16_t length;
+	uint16_t loop_start;
+	uint16_t loop_end;
+	uint8_t volume;
+	uint8_t rsvd2;
+	uint16_t c2spd;
+	uint16_t length_par;
+	uint32_t rsvd3;
+	uint32_t data_offset;	/* 0 = no sample data */
+} stm_cache_sample_t;
+
+typedef struct stm_cache_header_s {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t source_size;
+	int64_t source_mtime;
+	uint64_t source_hash;	/* FNV-1a of the whole module file */
+	uint8_t tempo;
+	uint8_t global_volume;
+	uint8_t patterns;
+	uint8_t reserved;
+	uint32_t order_offset;	/* 256 orders */
+	uint32_t pattern_offset;	/* patterns * 1024 + 1 bytes, already expanded */
+	uint32_t track_offset;	/* patterns * 4 decoded tracks */
+	uint32_t size;		/* of the whole cache file */
+	uint32_t reserved2;
+	stm_cache_sample_t samples[32];
+} stm_cache_header_t;
+
+// Checks the 48-byte file header as every loader does, the tempo comes out in
+// the 2.21 format. Returns 0 or one of the STM_BAD_* / STM_OLD_* codes.
+int stm_read_header(const uint8_t *data, size_t size, stm_header_t *stm);
+
+// Each returns a song holding one reference, or NULL on failure. The sample
+// files of songs (type 1) are looked for next to the module.
+st2_song_t *stm_load_song(const char *filename);
+// Also searches the ':'-separated directories of 'sample_path'.
+st2_song_t *stm_load_song_paths(const char *filename, const char *sample_path);
+// Sample data points into 'data', which must outlive the song.
+st2_song_t *stm_load_song_mem(const uint8_t *data, size_t size);
+st2_song_t *stm_load_song_mmap(const char *filename);
+// Reads headers and patterns only, each sample is read the first time it is
+// played: a blocking read on the rendering thread. A few rows earlier the
+// kernel is asked to read it ahead, so that read usually hits the page cache.
+st2_song_t *stm_load_song_lazy(const char *filename);
+// Maps the decoded song from 'cache_dir' when the module hasn't changed since
+// it was cached, otherwise loads the module and writes the cache for next time.
+st2_song_t *stm_load_song_cached(const char *filename, const char *cache_dir);
+
+// Load a song and attach it to 'ctx'.
 int stm_load(st2_context_t *ctx, const char *filename);
+int stm_load_mem(st2_context_t *ctx, const uint8_t *data, size_t size);
+int stm_load_mmap(st2_context_t *ctx, const char *filename);
+int stm_load_lazy(st2_context_t *ctx, const char *filename);
+int stm_load_paths(st2_context_t *ctx, const char *filename, const char *sample_path);
+int stm_load_cached(st2_context_t *ctx, const char *filename, const char *cache_dir);
 
 #endif
@@ -18,25 +18,325 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#ifndef ST2_NO_SDL
 #include <SDL.h>
+// The render thread, the ring's atomics and the deadline statistics are SDL2 only.
+#if !SDL_VERSION_ATLEAST(2, 0, 0)
+#error "stmod needs SDL2, see SDL_CFLAGS in the Makefile"
+#endif
+#endif
 
 #include "st2play.h"
 #include "stmload.h"
+#include "st2resample.h"
+#ifndef ST2_NO_SDL
+#include "st2ring.h"
+#include "st2stats.h"
+#endif
 
 //#define SAMPLING_FREQ  23863
 #define SAMPLING_FREQ  48000
-#define BUFFER_SAMPLES 16384
+#define BUFFER_SAMPLES 2048
+#define LATENCY_MS     100
+#define RENDER_FRAMES  16384
 
+#define FORMAT_U8      0
+#define FORMAT_S16     1
+#define FORMAT_F32     2
+
+static int out_format = FORMAT_U8;
+static int out_channels = 1;
+
+// Resampled output: native frames rendered ahead of the resampler, one per render or player.
+typedef struct stream_s {
+	st2_resampler_t *resampler;
+	float native[RENDER_FRAMES];
+	float resampled[RENDER_FRAMES];
+	size_t native_pos, native_count;
+} stream_t;
+
+#ifndef ST2_NO_SDL
+typedef struct player_s {
+	st2_context_t *ctx;
+	stream_t *stream;	/* NULL at the native rate */
+	st2_ring_t ring;
+	size_t target;		/* bytes the render thread keeps buffered */
+	SDL_atomic_t running;
+	SDL_atomic_t finished;
+	st2_stats_t callback_stats;
+	st2_stats_t render_stats;
+} player_t;
+#endif
+
+static double now(void);
+static size_t frame_size(void);
+static stream_t *stream_create(uint32_t native_rate, uint32_t sample_rate);
+static void stream_destroy(stream_t *stream);
+static size_t render(st2_context_t *ctx, stream_t *stream, void *buf, size_t frames);
+static void store_frames(void *buf, const float *in, size_t frames);
+static size_t render_resampled(st2_context_t *ctx, stream_t *stream, void *buf, size_t frames);
+static void fputw(uint16_t data, FILE *fp);
+static void fputl(uint32_t data, FILE *fp);
+static void write_wav_header(FILE *fp, uint32_t sample_rate, uint32_t data_size);
+static int render_file(st2_context_t *ctx, stream_t *stream, const char *filename, int raw, uint32_t sample_rate, uint64_t max_frames);
+static void print_profile(st2_context_t *ctx);
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t frame_size(void)
+{
+	return out_channels * (out_format == FORMAT_U8 ? 1 : out_format == FORMAT_S16 ? 2 : 4);
+}
+
+static stream_t *stream_create(uint32_t native_rate, uint32_t sample_rate)
+{
+	stream_t *stream;
+
+	stream = (stream_t *)(calloc(1, sizeof(stream_t)));
+	if(stream == NULL)
+		return NULL;
+
+	if((stream->resampler = st2_resampler_create(native_rate, sample_rate)) == NULL) {
+		free(stream);
+		return NULL;
+	}
+
+	return stream;
+}
+
+static void stream_destroy(stream_t *stream)
+{
+	if(stream != NULL) {
+		st2_resampler_destroy(stream->resampler);
+		free(stream);
+	}
+}
+
+static size_t render(st2_context_t *ctx, stream_t *stream, void *buf, size_t frames)
+{
+	if(stream != NULL)
+		return render_resampled(ctx, stream, buf, frames);
+
+	// The song has ended and looped back, don't start it over.
+	if(st2_get_position(ctx) >> 8)
+		return 0;
+
+	switch(out_format)
+	{
+		case FORMAT_S16:
+			return out_channels == 2 ? st2_render_s16_stereo(ctx, buf, frames) : st2_render_s16(ctx, buf, frames);
+		case FORMAT_F32:
+			return out_channels == 2 ? st2_render_f32_stereo(ctx, buf, frames) : st2_render_f32(ctx, buf, frames);
+		default:
+			return out_channels == 2 ? st2_render_u8_stereo(ctx, buf, frames) : st2_render_block(ctx, buf, frames);
+	}
+}
+
+static void store_frames(void *buf, const float *in, size_t frames)
+{
+	size_t i, j;
+	float v;
+	int s;
+
+	for(i = 0; i < frames; ++i)
+	{
+		v = in[i] < -1.0f ? -1.0f : in[i] > 1.0f ? 1.0f : in[i];
+		for(j = 0; j < out_channels; ++j)
+		{
+			switch(out_format)
+			{
+				case FORMAT_S16:
+					s = (int)(v * 32768 + (v < 0 ? -0.5f : 0.5f));
+					((int16_t *)buf)[i * out_channels + j] = s > 32767 ? 32767 : s;
+					break;
+				case FORMAT_F32:
+					((float *)buf)[i * out_channels + j] = v;
+					break;
+				default:
+					s = (int)(v * 128 + (v < 0 ? -0.5f : 0.5f)) + 128;
+					((uint8_t *)buf)[i * out_channels + j] = s > 255 ? 255 : s;
+					break;
+			}
+		}
+	}
+}
+
+// Mono float at the native rate, resampled and converted to the output format.
+static size_t render_resampled(st2_context_t *ctx, stream_t *stream, void *buf, size_t frames)
+{
+	size_t in, n, done = 0;
+
+	while(done < frames) {
+		if(stream->native_pos == stream->native_count && !(st2_get_position(ctx) >> 8)) {
+			stream->native_count = st2_render_f32(ctx, stream->native, RENDER_FRAMES);
+			stream->native_pos = 0;
+		}
+
+		in = stream->native_count - stream->native_pos;
+		n = frames - done < RENDER_FRAMES ? frames - done : RENDER_FRAMES;
+		if(in != 0) {
+			n = st2_resample(stream->resampler, stream->native + stream->native_pos, &in, stream->resampled, n);
+			stream->native_pos += in;
+		} else if((n = st2_resample_flush(stream->resampler, stream->resampled, n)) == 0) {
+			// The song has ended and the filter has given back its last frames.
+			break;
+		}
+
+		store_frames((uint8_t *)buf + done * frame_size(), stream->resampled, n);
+		done += n;
+	}
+
+	return done;
+}
+
+static void fputw(uint16_t data, FILE *fp)
+{
+	fputc(data & 0xff, fp);
+	fputc(data >> 8, fp);
+}
+
+static void fputl(uint32_t data, FILE *fp)
+{
+	fputw(data & 0xffff, fp);
+	fputw(data >> 16, fp);
+}
+
+static void write_wav_header(FILE *fp, uint32_t sample_rate, uint32_t data_size)
+{
+	fwrite("RIFF", 1, 4, fp);
+	fputl(data_size + 36, fp);
+	fwrite("WAVEfmt ", 1, 8, fp);
+	fputl(16, fp);
+	fputw(out_format == FORMAT_F32 ? 3 : 1, fp);	/* IEEE float or PCM */
+	fputw(out_channels, fp);
+	fputl(sample_rate, fp);
+	fputl(sample_rate * frame_size(), fp);	/* bytes per second */
+	fputw(frame_size(), fp);		/* block align */
+	fputw(8 * frame_size() / out_channels, fp);	/* bits per sample */
+	fwrite("data", 1, 4, fp);
+	fputl(data_size, fp);
+}
+
+static int render_file(st2_context_t *ctx, stream_t *stream, const char *filename, int raw, uint32_t sample_rate, uint64_t max_frames)
+{
+	FILE *fp;
+	uint8_t buf[RENDER_FRAMES * 8];
+	uint64_t total = 0, size;
+	size_t want, done;
+	double start, elapsed;
+
+	fp = strcmp(filename, "-") ? fopen(filename, "wb") : stdout;
+	if(fp == NULL) {
+		fprintf(stderr, "can't open %s for writing\n", filename);
+		return -1;
+	}
+
+	// Unknown length yet, patched below when the output is seekable.
+	if(!raw)
+		write_wav_header(fp, sample_rate, 0xffffffff - 36);
+
+	start = now();
+
+	while(max_frames == 0 || total < max_frames) {
+		want = RENDER_FRAMES;
+		if(max_frames != 0 && max_frames - total < want)
+			want = max_frames - total;
+
+		done = render(ctx, stream, buf, want);
+		if(fwrite(buf, frame_size(), done, fp) != done) {
+			fprintf(stderr, "write error on %s\n", filename);
+			break;
+		}
+		total += done;
+
+		if(done < want)
+			break;
+	}
+
+	elapsed = now() - start;
+
+	size = total * frame_size();
+	if(!raw && fseek(fp, 0, SEEK_SET) == 0)
+		write_wav_header(fp, sample_rate, size > 0xffffffff - 36 ? 0xffffffff - 36 : (uint32_t)size);
+
+	if(fp != stdout)
+		fclose(fp);
+	else
+		fflush(fp);
+
+	fprintf(stderr, "%llu frames (%.2f s) in %.3f s", (unsigned long long)total, (double)total / sample_rate, elapsed);
+	if(elapsed > 0)
+		fprintf(stderr, ": %.0f frames/s, %.1fx realtime", total / elapsed, total / elapsed / sample_rate);
+	fprintf(stderr, "\n");
+
+	return 0;
+}
+
+#ifndef ST2_NO_SDL
+static uint64_t elapsed_ns(Uint64 start)
+{
+	return (SDL_GetPerformanceCounter() - start) * 1000000000.0 / SDL_GetPerformanceFrequency();
+}
+
+// Producer: keeps the ring topped up to the target latency.
+static int render_thread(void *data)
+{
+	player_t *player = (player_t *)data;
+	uint8_t buf[RENDER_FRAMES * 8];
+	size_t want, done;
+	Uint64 start;
+
+	while(SDL_AtomicGet(&player->running)) {
+		want = st2_ring_readable(&player->ring);
+		want = want < player->target ? (player->target - want) / frame_size() : 0;
+		if(want == 0) {
+			SDL_Delay(1);
+			continue;
+		}
+
+		if(want > RENDER_FRAMES)
+			want = RENDER_FRAMES;
+
+		start = SDL_GetPerformanceCounter();
+		done = render(player->ctx, player->stream, buf, want);
+		st2_ring_write(&player->ring, buf, done * frame_size());
+		st2_stats_record(&player->render_stats, want, elapsed_ns(start), 0);
+
+		if(done < want) {
+			SDL_AtomicSet(&player->finished, 1);
+			break;
+		}
+	}
+
+	return 0;
+}
+
+// Consumer: the audio callback only copies out of the ring.
 static void fill_audio(void *udata, Uint8 *stream, int len)
 {
-	int i;
+	player_t *player = (player_t *)udata;
+	Uint64 start = SDL_GetPerformanceCounter();
+	size_t done;
+
+	done = st2_ring_read(&player->ring, stream, len);
 
-	for(i = 0; i < len; i++)
-		stream[i] = st2_get_position((st2_context_t *)udata) >> 8 ? 128 : st2_render_sample((st2_context_t *)udata);
+	memset(stream + done, out_format == FORMAT_U8 ? 128 : 0, len - done);
+
+	// running short after the last rendered frame is just the song ending
+	st2_stats_record(&player->callback_stats, len / frame_size(), elapsed_ns(start),
+		done < (size_t)len && !SDL_AtomicGet(&player->finished));
 }
 
-static int sdl_init(st2_context_t *ctx)
+static int sdl_init(player_t *player, uint32_t sample_rate, uint16_t buffer_samples)
 {
 	SDL_AudioSpec audiospec;
 
@@ -45,12 +345,12 @@ static int sdl_init(st2_context_t *ctx)
 		return -1;
 	}
 
-	audiospec.freq = SAMPLING_FREQ;
-	audiospec.format = AUDIO_U8;
-	audiospec.channels = 1;
-	audiospec.samples = BUFFER_SAMPLES;
+	audiospec.freq = sample_rate;
+	audiospec.format = out_format == FORMAT_S16 ? AUDIO_S16SYS : out_format == FORMAT_F32 ? AUDIO_F32SYS : AUDIO_U8;
+	audiospec.channels = out_channels;
+	audiospec.samples = buffer_samples;
 	audiospec.callback = fill_audio;
-	audiospec.userdata = ctx;
+	audiospec.userdata = player;
 
 	if (SDL_OpenAudio(&audiospec, NULL) < 0) {
 		fprintf(stderr, "%s\n", SDL_GetError());
@@ -60,38 +360,286 @@ static int sdl_init(st2_context_t *ctx)
 	return 0;
 }
 
+static void report(player_t *player)
+{
+	st2_stats_report(&player->callback_stats, "callback", stderr);
+	st2_stats_report(&player->render_stats, "render", stderr);
+}
+
+static int play(st2_context_t *ctx, stream_t *stream, uint32_t sample_rate, uint16_t buffer_samples, uint32_t latency_ms, uint32_t report_ms)
+{
+	player_t player;
+	SDL_Thread *thread;
+	Uint32 next_report;
+
+	player.ctx = ctx;
+	player.stream = stream;
+	player.target = (size_t)sample_rate * latency_ms / 1000;
+	if(player.target < buffer_samples)
+		player.target = buffer_samples;
+	player.target *= frame_size();
+	SDL_AtomicSet(&player.running, 1);
+	SDL_AtomicSet(&player.finished, 0);
+	st2_stats_init(&player.callback_stats, sample_rate);
+	st2_stats_init(&player.render_stats, sample_rate);
+
+	if(st2_ring_init(&player.ring, 2 * player.target) < 0)
+		return -1;
+
+	if(sdl_init(&player, sample_rate, buffer_samples) < 0) {
+		st2_ring_free(&player.ring);
+		return -1;
+	}
+
+	if((thread = SDL_CreateThread(render_thread, "st2render", &player)) == NULL) {
+		fprintf(stderr, "%s\n", SDL_GetError());
+		SDL_CloseAudio();
+		st2_ring_free(&player.ring);
+		return -1;
+	}
+
+	// Prefill before the device starts pulling.
+	while(!SDL_AtomicGet(&player.finished) && st2_ring_readable(&player.ring) < player.target)
+		SDL_Delay(1);
+
+	SDL_PauseAudio(0);
+	next_report = SDL_GetTicks() + report_ms;
+
+	while(!SDL_AtomicGet(&player.finished) || st2_ring_readable(&player.ring) != 0) {
+		SDL_Delay(10);
+		if(report_ms && (Sint32)(SDL_GetTicks() - next_report) >= 0) {
+			report(&player);
+			next_report += report_ms;
+		}
+	}
+
+	SDL_AtomicSet(&player.running, 0);
+	SDL_WaitThread(thread, NULL);
+
+	SDL_CloseAudio();
+	st2_ring_free(&player.ring);
+
+	if(report_ms)
+		report(&player);
+
+	return 0;
+}
+#endif
+
+static void print_profile(st2_context_t *ctx)
+{
+	st2_profile_t p;
+	int i;
+
+	if(st2_get_profile(ctx, &p)) {
+		fprintf(stderr, "profile: built without ST2_PROFILE\n");
+		return;
+	}
+
+	fprintf(stderr, "profile: %llu ticks, %llu rows, %llu frequency updates, %llu loop wraps\n",
+		(unsigned long long)p.ticks, (unsigned long long)p.rows, (unsigned long long)p.frequency_updates, (unsigned long long)p.loop_wraps);
+	fprintf(stderr, "profile: %llu mix cycles, %llu tick cycles\n", (unsigned long long)p.mix_cycles, (unsigned long long)p.tick_cycles);
+	for(i = 0; i < 5; ++i)
+		fprintf(stderr, "profile: %llu frames with %d voices\n", (unsigned long long)p.mixed_frames[i], i);
+	for(i = 0; i < 16; ++i)
+		if(p.row_effects[i] || p.tick_effects[i])
+			fprintf(stderr, "profile: command %X %llu rows, %llu ticks\n", i, (unsigned long long)p.row_effects[i], (unsigned long long)p.tick_effects[i]);
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [options] <filename>\n", name);
+	printf("  -o <file>    render to a WAV file ('-' for stdout) instead of playing\n");
+	printf("  -r           with -o, write raw PCM instead of WAV\n");
+	printf("  -b <format>  sample format: u8 (default), s16 or f32\n");
+	printf("  -2           stereo output (the mix on both channels)\n");
+	printf("  -s <rate>    sample rate (default %d)\n", SAMPLING_FREQ);
+	printf("  -n <rate>    run the replayer at this rate (e.g. 15909) and resample to -s\n");
+	printf("  -f <frames>  with -o, stop after this many frames\n");
+	printf("  -t <secs>    with -o, stop after this many seconds\n");
+	printf("  -d           print the song length and loop point and exit\n");
+	printf("  -l           read samples when they are first played, not all up front\n");
+	printf("  -C <dir>     keep decoded modules in this cache directory\n");
+	printf("  -p <dirs>    ':'-separated directories to look for sample files in\n");
+	printf("  -M <MB>      reuse the mix of repeated patterns, keeping up to this much of it\n");
+	printf("  -P           print engine counters to stderr at exit (ST2_PROFILE builds)\n");
+	printf("  -B <frames>  audio device buffer size (default %d)\n", BUFFER_SAMPLES);
+	printf("  -L <ms>      audio rendered ahead of the device (default %d)\n", LATENCY_MS);
+	printf("  -S <secs>    print callback and render timing to stderr this often\n");
+	exit(-1);
+}
+
 int main(int argc, char *argv[])
 {
 	st2_context_t *context;
+	const char *filename = NULL, *output = NULL, *cache_dir = NULL, *sample_path = NULL;
+	uint32_t sample_rate = SAMPLING_FREQ, native_rate = 0, render_rate;
+	uint64_t max_frames = 0;
+	uint32_t buffer_samples = BUFFER_SAMPLES, latency_ms = LATENCY_MS, report_ms = 0;
+	double max_seconds = 0;
+	size_t memo_mb = 0;
+	st2_memo_t *memo = NULL;
+	stream_t *stream = NULL;
+	st2_timeline_t timeline;
+	int i, raw = 0, duration = 0, lazy = 0, profile = 0, result = 0;
 
-	if (argc < 2)
+	for(i = 1; i < argc; ++i)
 	{
-		printf("Usage: %s <filename>\n", argv[0]);
-		exit(-1);
+		if(argv[i][0] != '-' || argv[i][1] == '\0') {
+			filename = argv[i];
+			continue;
+		}
+
+		if(argv[i][1] == 'r') {
+			raw = 1;
+			continue;
+		}
+
+		if(argv[i][1] == 'd') {
+			duration = 1;
+			continue;
+		}
+
+		if(argv[i][1] == 'l') {
+			lazy = 1;
+			continue;
+		}
+
+		if(argv[i][1] == 'P') {
+			profile = 1;
+			continue;
+		}
+
+		if(argv[i][1] == '2') {
+			out_channels = 2;
+			continue;
+		}
+
+		if(i + 1 >= argc)
+			usage(argv[0]);
+
+		switch(argv[i][1])
+		{
+			case 'o':
+				output = argv[++i];
+				break;
+			case 'C':
+				cache_dir = argv[++i];
+				break;
+			case 'p':
+				sample_path = argv[++i];
+				break;
+			case 'M':
+				memo_mb = strtoul(argv[++i], NULL, 10);
+				break;
+			case 's':
+				sample_rate = strtoul(argv[++i], NULL, 10);
+				break;
+			case 'n':
+				native_rate = strtoul(argv[++i], NULL, 10);
+				break;
+			case 'b':
+				++i;
+				if(!strcmp(argv[i], "s16"))
+					out_format = FORMAT_S16;
+				else if(!strcmp(argv[i], "f32"))
+					out_format = FORMAT_F32;
+				else if(strcmp(argv[i], "u8"))
+					usage(argv[0]);
+				break;
+			case 'B':
+				buffer_samples = strtoul(argv[++i], NULL, 10);
+				break;
+			case 'L':
+				latency_ms = strtoul(argv[++i], NULL, 10);
+				break;
+			case 'S':
+				report_ms = strtod(argv[++i], NULL) * 1000;
+				break;
+			case 'f':
+				max_frames = strtoull(argv[++i], NULL, 10);
+				break;
+			case 't':
+				max_seconds = strtod(argv[++i], NULL);
+				break;
+			default:
+				usage(argv[0]);
+		}
 	}
 
+	// Only the replayer itself is limited to 16-bit rates.
+	render_rate = native_rate ? native_rate : sample_rate;
+	if (filename == NULL || sample_rate == 0 || sample_rate > 384000 || render_rate > 65535 || buffer_samples == 0 || buffer_samples > 32768)
+		usage(argv[0]);
+
+	// Each picks a different loader, none of them takes the others' options.
+	if(lazy + (cache_dir != NULL) + (sample_path != NULL) > 1) {
+		fprintf(stderr, "-l, -C and -p can't be combined\n");
+		return 1;
+	}
+
+	if(max_seconds > 0 && (max_frames == 0 || max_seconds * sample_rate < max_frames))
+		max_frames = (uint64_t)(max_seconds * sample_rate);
+
 	context = st2_tracker_init();
 
-	if(stm_load(context, argv[1]))
+	if(cache_dir != NULL)
+		result = stm_load_cached(context, filename, cache_dir);
+	else if(sample_path != NULL)
+		result = stm_load_paths(context, filename, sample_path);
+	else
+		result = (lazy ? stm_load_lazy : stm_load)(context, filename);
+
+	if(result)
 	    return 1;
 
-	st2_tracker_start(context, SAMPLING_FREQ);
+	st2_tracker_start(context, render_rate);
 	st2_set_position(context, 0);
 
-	if(sdl_init(context) < 0)
-	{
-		fprintf(stderr, "%s: can't initialize sound\n", argv[0]);
+	if(duration) {
+		st2_analyze_timeline(context, &timeline);
+		printf("%.2f s, %s to order %d at %.2f s\n", (double)timeline.length / render_rate,
+			timeline.loop_marker ? "ends and restarts" : "jumps back", timeline.loop_order, (double)timeline.loop_frame / render_rate);
+		st2_tracker_destroy(context);
+		return 0;
+	}
+
+	if(native_rate && (stream = stream_create(native_rate, sample_rate)) == NULL) {
+		fprintf(stderr, "%s: can't create the resampler\n", argv[0]);
+		st2_tracker_destroy(context);
 		return 1;
 	}
 
-	SDL_PauseAudio(0);
+	if(memo_mb && (memo = st2_memo_create(memo_mb << 20)) != NULL)
+		st2_set_memo(context, memo);
 
-	while(!(st2_get_position(context) >> 8))
-		SDL_Delay(10);
+	if(output != NULL) {
+		result = render_file(context, stream, output, raw, sample_rate, max_frames) ? 1 : 0;
+		if(profile)
+			print_profile(context);
+		stream_destroy(stream);
+		st2_tracker_destroy(context);
+		st2_memo_destroy(memo);
+		return result;
+	}
 
-	SDL_CloseAudio();
+#ifdef ST2_NO_SDL
+	fprintf(stderr, "%s: built without SDL, use -o to render to a file\n", argv[0]);
+	(void)latency_ms;
+	(void)report_ms;
+	result = 1;
+#else
+	if(play(context, stream, sample_rate, buffer_samples, latency_ms, report_ms) < 0)
+	{
+		fprintf(stderr, "%s: can't initialize sound\n", argv[0]);
+		result = 1;
+	}
+#endif
+	if(profile)
+		print_profile(context);
+	stream_destroy(stream);
 	st2_tracker_destroy(context);
+	st2_memo_destroy(memo);
 
-	return 0;
+	return result;
 }
-